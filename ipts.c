@@ -1,48 +1,159 @@
+#define _GNU_SOURCE
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <linux/hidraw.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
 #include <math.h>
 #include <png.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
 
 #define SCALE 16
-#define WIDTH 64
-#define HEIGHT 44
+// Heatmap sizes the pipeline is built for, as width and height in pixels
+// A heatmap is matched to a geometry by the size of its report, and each geometry has its own copy of the
+// heatmap pipeline with constant loop bounds, see find_clusters.
+#define GEOMETRIES(X) \
+  X(64, 44)           \
+  X(72, 48)
+// Largest heatmap of any geometry, used to size buffers
+#define MAX_WIDTH 72
+#define MAX_HEIGHT 48
+// Range of touch orientations given to uinput, a quarter turn either way from the Y axis
+#define TOUCH_MAX_ORIENTATION 90
 #define MAX_CLUSTER_SIZE 128
 #define MAX_CLUSTERS 16
+// Basins found by watershed before merging, and how far below the dimmer of two peaks the pass between them
+// must be for them to stay separate touches
+#define WATERSHED_MAX_BASINS 255
+#define WATERSHED_DEPTH 16
+// Most labels connected_components can give out before joining them, one for every other pixel of every other row
+#define MAX_COMPONENTS ((MAX_WIDTH + 1) / 2 * ((MAX_HEIGHT + 1) / 2))
+// Raw values within this distance of the idle level are treated as black
+#define HEATMAP_THRESHOLD 100
+// Largest frame read from the device, the size of a Surface Pro 5 frame; shorter ones are padded with zeros
+#define FRAME_SIZE 7485
+// How long to wait for a heatmap at startup to find out the geometry of the touch device
+#define PROBE_MS 1000
+// Furthest a touch is expected to move between heatmaps, in pixels
+#define TRACKING_GATE 8.0f
+// Distance off the heatmap that padding is placed at when pairing clusters, far enough to always be gated out
+#define TRACKING_FAR 1000.f
+// Fraction bits of fixed point touch positions
+#define SUBPIXEL_BITS 8
+// Noise of a measured touch position in pixels^2, and of a touch's acceleration in pixels^2/s^3
+#define PREDICT_MEASUREMENT_NOISE 0.01f
+#define PREDICT_PROCESS_NOISE 8000.f
+// Uncertainty of a new touch's velocity in (pixels/s)^2
+#define PREDICT_VELOCITY_NOISE 400.f
+// Interval assumed between heatmaps when the measured one is implausible, as in a replay
+#define HEATMAP_PERIOD_MS 8
+// Interval assumed between the frames of a raw capture, which has no times. Heatmaps and stylus reports take
+// turns, so this is about half a heatmap period.
+#define RAW_FRAME_PERIOD_US 4000
+#define MAX_BATCH_EVENTS 256
+#define TOUCH_SLOTS 6
+// Interval of the event loop's housekeeping timer, and how long touches stay down without a heatmap
+#define HOUSEKEEPING_MS 50
+#define STALE_TOUCH_MS 100
+// Number of stylus elements the log can hold, and how often the log thread checks it
+#define STYLUS_LOG_SIZE 1024
+#define LOG_POLL_MS 10
+// Length of a stylus element timestamp tick
+#define STYLUS_TICK_NS 100000
+// How far the stylus clock may drift from the monotonic clock per element, and how far an element may appear
+// to be late before its timestamps are assumed to have wrapped and are anchored again
+#define STYLUS_DRIFT_NS 1000
+#define STYLUS_REANCHOR_MS 50
+// Most resampled positions written for one element, and furthest a position is extrapolated
+#define STYLUS_MAX_RESAMPLES 16
+#define STYLUS_MAX_PREDICT_MS 20
+// Enough histogram buckets for durations up to 2^40 ticks
+#define HISTOGRAM_BUCKETS 160
+// Number of raw frames and flushed event batches that can be waiting between pipeline threads
+#define PIPELINE_FRAMES 64
+#define PIPELINE_BATCHES 64
 
-struct pixel {
-  uint8_t x;
-  uint8_t y;
-  uint8_t value;
-};
+// Bits of ipts_stylus_element->mode
+#define STYLUS_MODE_PROXIMITY 0x01
+#define STYLUS_MODE_CONTACT 0x02
+#define STYLUS_MODE_BUTTON 0x04
+#define STYLUS_MODE_ERASER 0x08
 
-struct cluster {
-  uint8_t size;
-  struct pixel pixels[MAX_CLUSTER_SIZE];
-  float centre_x;
-  float centre_y;
-  float x1;
-  float y1;
-  float x2;
-  float y2;
-  float diameter;
-  uint8_t valid;
-  int id;
+// Number of 64 bit words needed to hold one bit per pixel in a row
+#define ROW_WORDS ((MAX_WIDTH + 63) / 64)
+
+// Functions of the heatmap pipeline take the geometry as arguments and are always inlined, so each geometry's
+// copy is compiled with the width and height as constants
+#define GEOMETRY_INLINE static inline __attribute__((always_inline))
+
+// Instruction sets the vector kernels are built for
+// On x86 each kernel has a default variant, using SSE2 where the compiler allows it, and variants for AVX2 and
+// AVX-512 that are compiled for those instruction sets whatever the compiler flags. The widest one the CPU
+// supports is chosen at startup, see detect_isa.
+enum isa {
+  ISA_DEFAULT,
+  ISA_AVX2,
+  ISA_AVX512,
+  ISA_COUNT
 };
 
+const char *isa_names[ISA_COUNT] = {"default", "avx2", "avx512"};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VECTOR_DISPATCH
+#define ISAS(X, ...) X(default, __VA_ARGS__) X(avx2, __VA_ARGS__) X(avx512, __VA_ARGS__)
+#else
+#define ISAS(X, ...) X(default, __VA_ARGS__)
+#endif
+#define TARGET_default
+#define TARGET_avx2 __attribute__((target("avx2")))
+#define TARGET_avx512 __attribute__((target("avx2,avx512f,avx512bw")))
+
+// Clusters are stored as parallel arrays so the bounds, overlap and tracking passes each touch only the
+// fields they need. Pixels live in a per-frame arena of heatmap indices; each cluster owns a contiguous
+// run of it starting at its offset, and the first pixel of a run is the peak the cluster grew from.
 struct cluster_group {
   uint8_t size;
-  struct cluster clusters[MAX_CLUSTERS];
+  uint16_t offset[MAX_CLUSTERS];
+  uint16_t count[MAX_CLUSTERS];
+  float centre_x[MAX_CLUSTERS];
+  float centre_y[MAX_CLUSTERS];
+  float x1[MAX_CLUSTERS];
+  float y1[MAX_CLUSTERS];
+  float x2[MAX_CLUSTERS];
+  float y2[MAX_CLUSTERS];
+  float diameter[MAX_CLUSTERS];
+  // Shape of the touch, the axes of an ellipse in pixels and the angle of its major axis, see fit_ellipse
+  float major[MAX_CLUSTERS];
+  float minor[MAX_CLUSTERS];
+  float orientation[MAX_CLUSTERS];
+  uint8_t valid[MAX_CLUSTERS];
+  int id[MAX_CLUSTERS];
 };
 
 struct ipts_hid_header {
@@ -90,84 +201,1287 @@ struct ipts_stylus_element {
   uint8_t reserved[2];
 } __attribute__((packed));
 
-// Add a pixel to a cluster if it is dimmer than a threshold
-// This function calls itself recursively to add surrounding pixels to the cluster until
-// it enounters a pixel that is brighter than the previous one, or black.
-void assign_group_dimmer(struct pixel *pixels, int x, int y, struct cluster *cluster, int threshold) {
-  // Abort if the cluster has clready reached its maximum size
-  if (cluster->size >= MAX_CLUSTER_SIZE) return;
+// The reports of one frame, each checked to lie inside the frame before any of them is used
+#define MAX_REPORTS 64
+
+struct report_view {
+  uint8_t type;
+  uint16_t size;
+  uint8_t *data;
+};
+
+struct frame_view {
+  int count;
+  struct report_view reports[MAX_REPORTS];
+};
+
+// Copy a raw heatmap, inverting both axes as well as the values and removing the background
+// Flipping both axes of a row-major image is the same as reversing it, so the whole heatmap is read backwards
+// in vector-sized blocks. Each block is byte-reversed and subtracted from (255 - HEATMAP_THRESHOLD) with
+// saturation, which inverts and thresholds in one step. Each variant starts at pixel i, handles the blocks
+// it can and leaves the rest to a narrower one. The row after the heatmap is cleared, see find_peaks.
+GEOMETRY_INLINE void transform_heatmap_default(const uint8_t *raw, uint8_t *heatmap, int width, int height, int i) {
+  const int size = width * height;
+#ifdef __SSE2__
+  const __m128i level = _mm_set1_epi8(255 - HEATMAP_THRESHOLD);
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(raw + size - 16 - i));
+    // Swap the bytes in each 16 bit word, then reverse the order of the words
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    _mm_storeu_si128((__m128i *)(heatmap + i), _mm_subs_epu8(level, v));
+  }
+#endif
+  for (; i < size; i++) {
+    int value = 255 - raw[size - 1 - i] - HEATMAP_THRESHOLD;
+    heatmap[i] = value < 0 ? 0 : value;
+  }
+  memset(heatmap + size, 0, width);
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_avx2 GEOMETRY_INLINE void transform_heatmap_avx2(const uint8_t *raw, uint8_t *heatmap, int width, int height, int i) {
+  const int size = width * height;
+  const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  const __m256i level = _mm256_set1_epi8(255 - HEATMAP_THRESHOLD);
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(raw + size - 32 - i));
+    // Reverse the bytes within each 128 bit lane, then swap the lanes
+    v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, reverse), _MM_SHUFFLE(1, 0, 3, 2));
+    _mm256_storeu_si256((__m256i *)(heatmap + i), _mm256_subs_epu8(level, v));
+  }
+  transform_heatmap_default(raw, heatmap, width, height, i);
+}
 
-  // Abort if the pixel is already in this cluster
-  for (int n = 0; n < cluster->size; n++) {
-    if (cluster->pixels[n].x == x && cluster->pixels[n].y == y) return;
+TARGET_avx512 GEOMETRY_INLINE void transform_heatmap_avx512(const uint8_t *raw, uint8_t *heatmap, int width, int height, int i) {
+  const int size = width * height;
+  const __m512i reverse = _mm512_broadcast_i32x4(_mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+  const __m512i level = _mm512_set1_epi8(255 - HEATMAP_THRESHOLD);
+  for (; i + 64 <= size; i += 64) {
+    __m512i v = _mm512_loadu_si512((const void *)(raw + size - 64 - i));
+    // Reverse the bytes within each 128 bit lane, then reverse the order of the lanes
+    v = _mm512_shuffle_epi8(v, reverse);
+    v = _mm512_shuffle_i64x2(v, v, _MM_SHUFFLE(0, 1, 2, 3));
+    _mm512_storeu_si512((void *)(heatmap + i), _mm512_subs_epu8(level, v));
   }
+  transform_heatmap_avx2(raw, heatmap, width, height, i);
+}
+#endif
+
+// Offsets of the eight neighbours of a pixel, in the order clusters are grown
+const int8_t neighbour_dx[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
+const int8_t neighbour_dy[8] = {-1, 0, 1, -1, 1, -1, 0, 1};
+
+// Grow a cluster from a bright pixel by adding surrounding pixels
+// Each neighbour is added if it is not black and not brighter than the pixel it was reached from, so the
+// cluster spreads downhill until it meets a brighter pixel or black. Pixels are visited depth first from an
+// explicit stack, and membership is tracked in a bitmap, so each visit is constant time and the stack is
+// bounded by MAX_CLUSTER_SIZE. The heatmap index of each pixel is appended to pixels, and the number added
+// is returned.
+GEOMETRY_INLINE int assign_group_dimmer(const uint8_t *heatmap, int x, int y, uint16_t *pixels, int width, int height) {
+  const int row_words = (width + 63) / 64;
+  uint64_t member[MAX_HEIGHT * ROW_WORDS];
+  struct {
+    uint8_t x;
+    uint8_t y;
+    uint8_t next;
+  } stack[MAX_CLUSTER_SIZE];
+  int depth = 0;
+  int size = 0;
 
   // Abort if the pixel is black
-  if (pixels[y * WIDTH + x].value == 0) return;
-  // Abort if the pixel is brighter than the threshold
-  if (pixels[y * WIDTH + x].value > threshold) return;
+  if (heatmap[y * width + x] == 0) return 0;
+
+  memset(member, 0, sizeof(uint64_t) * height * row_words);
+  member[y * row_words + x / 64] |= 1ull << (x % 64);
+  pixels[size++] = y * width + x;
+  stack[depth].x = x;
+  stack[depth].y = y;
+  stack[depth++].next = 0;
+
+  while (depth > 0) {
+    // Move on to the next neighbour of the pixel on top of the stack, or drop it once all have been visited
+    int top = depth - 1;
+    if (stack[top].next == 8) {
+      depth--;
+      continue;
+    }
+    int nx = stack[top].x + neighbour_dx[stack[top].next];
+    int ny = stack[top].y + neighbour_dy[stack[top].next];
+    stack[top].next++;
+    if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+
+    // Stop once the cluster has reached its maximum size
+    if (size >= MAX_CLUSTER_SIZE) return size;
+    // Skip the pixel if it is already in this cluster
+    if (member[ny * row_words + nx / 64] & (1ull << (nx % 64))) continue;
+    // Skip the pixel if it is black or brighter than the one we came from
+    uint8_t value = heatmap[ny * width + nx];
+    if (value == 0 || value > heatmap[stack[top].y * width + stack[top].x]) continue;
+
+    // Add the pixel to the cluster and continue from it
+    member[ny * row_words + nx / 64] |= 1ull << (nx % 64);
+    pixels[size++] = ny * width + nx;
+    stack[depth].x = nx;
+    stack[depth].y = ny;
+    stack[depth++].next = 0;
+  }
+  return size;
+}
+
+// Split the whole heatmap into clusters at once by flooding it from its peaks, brightest pixels first
+// Each plateau of peaks seeds a basin. Pixels are then taken from a queue with a bucket for each value,
+// brightest first and in the order they were reached within a bucket, and each passes its basin on to the
+// unlabelled pixels around it that are not black. Where two basins meet, the pixel they meet at is the
+// highest pass between them, and they are merged if that is less than WATERSHED_DEPTH below the dimmer
+// peak, so noise on a touch does not split it. Two touches close together then meet where their slopes do
+// rather than one growing over the other, and no pixel is in two clusters.
+// labels is left holding the basin of each pixel and 0 for black. The pixels of each cluster, up to
+// MAX_CLUSTERS in the order their seeds were found, are written to pixels with the brightest peak first,
+// and the number of clusters is returned.
+GEOMETRY_INLINE int watershed(const uint8_t *heatmap, const uint64_t *peaks, uint8_t *labels, struct cluster_group *cluster_group, uint16_t *pixels, int width, int height) {
+  const int size = width * height;
+  // Pixels in the order they were labelled, and the queue kept as a list through next for each value
+  uint16_t order[MAX_WIDTH * MAX_HEIGHT];
+  int16_t next[MAX_WIDTH * MAX_HEIGHT];
+  int16_t head[256];
+  int16_t tail[256];
+  // Basins are merged by pointing one at the other, and each root keeps its brightest seed
+  uint8_t parent[WATERSHED_MAX_BASINS + 1];
+  uint16_t seed[WATERSHED_MAX_BASINS + 1];
+  int labelled = 0;
+  int basins = 0;
+
+  memset(labels, 0, size);
+  memset(head, -1, sizeof(head));
+
+  // Seed a basin from each peak not yet labelled, and spread it over the peaks of the same value joined to
+  // it, so a plateau is one seed rather than many
+  for (int w = 0; w < (size + 63) / 64; w++) {
+    for (uint64_t mask = peaks[w]; mask && basins < WATERSHED_MAX_BASINS; mask &= mask - 1) {
+      int i = w * 64 + __builtin_ctzll(mask);
+      if (labels[i]) continue;
+      labels[i] = ++basins;
+      parent[basins] = basins;
+      seed[basins] = i;
+      order[labelled++] = i;
+      for (int p = labelled - 1; p < labelled; p++) {
+        for (int k = 0; k < 8; k++) {
+          int nx = order[p] % width + neighbour_dx[k];
+          int ny = order[p] / width + neighbour_dy[k];
+          if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+          int n = ny * width + nx;
+          if (labels[n] == 0 && heatmap[n] == heatmap[i] && (peaks[n / 64] >> (n % 64) & 1)) {
+            labels[n] = basins;
+            order[labelled++] = n;
+          }
+        }
+      }
+    }
+  }
+
+  // Flood from the seeds, queueing each pixel as it is labelled
+  int queued = 0;
+  int level = 0;
+  for (;;) {
+    for (; queued < labelled; queued++) {
+      int i = order[queued];
+      uint8_t value = heatmap[i];
+      next[i] = -1;
+      if (head[value] < 0) {
+        head[value] = i;
+      } else {
+        next[tail[value]] = i;
+      }
+      tail[value] = i;
+      if (value > level) level = value;
+    }
+    while (level > 0 && head[level] < 0) level--;
+    if (level == 0) break;
+    int i = head[level];
+    head[level] = next[i];
+    for (int k = 0; k < 8; k++) {
+      int nx = i % width + neighbour_dx[k];
+      int ny = i / width + neighbour_dy[k];
+      if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+      int n = ny * width + nx;
+      if (labels[n] == 0) {
+        if (heatmap[n] == 0) continue;
+        labels[n] = labels[i];
+        order[labelled++] = n;
+        continue;
+      }
+      // Another basin, merge the two if the pass between them is shallow
+      int a = labels[i];
+      int b = labels[n];
+      while (parent[a] != a) a = parent[a];
+      while (parent[b] != b) b = parent[b];
+      if (a == b) continue;
+      if (heatmap[seed[a]] < heatmap[seed[b]]) {
+        int swap = a;
+        a = b;
+        b = swap;
+      }
+      int pass = heatmap[n] < heatmap[i] ? heatmap[n] : heatmap[i];
+      if (heatmap[seed[b]] - pass < WATERSHED_DEPTH) parent[b] = a;
+    }
+  }
+
+  // Number the basins left after merging as clusters, and gather each cluster's pixels together after its
+  // seed, keeping the order they were labelled in
+  uint8_t cluster[WATERSHED_MAX_BASINS + 1];
+  int fill[MAX_CLUSTERS];
+  int clusters = 0;
+  cluster[0] = 0;
+  for (int l = 1; l <= basins; l++) {
+    int root = l;
+    while (parent[root] != root) root = parent[root];
+    parent[l] = root;
+    if (root == l) {
+      cluster[l] = clusters < MAX_CLUSTERS ? ++clusters : 0;
+      if (cluster[l]) cluster_group->count[cluster[l] - 1] = 0;
+    }
+  }
+  for (int l = 1; l <= basins; l++) cluster[l] = cluster[parent[l]];
+  for (int p = 0; p < labelled; p++) {
+    labels[order[p]] = cluster[labels[order[p]]];
+    if (labels[order[p]]) cluster_group->count[labels[order[p]] - 1]++;
+  }
+  for (int n = 0, offset = 0; n < clusters; n++) {
+    cluster_group->offset[n] = offset;
+    fill[n] = offset + 1;
+    offset += cluster_group->count[n];
+  }
+  for (int l = 1; l <= basins; l++) {
+    if (parent[l] == l && cluster[l]) pixels[cluster_group->offset[cluster[l] - 1]] = seed[l];
+  }
+  for (int p = 0; p < labelled; p++) {
+    int n = labels[order[p]];
+    if (n && order[p] != pixels[cluster_group->offset[n - 1]]) pixels[fill[n - 1]++] = order[p];
+  }
+  return clusters;
+}
+
+// Mark the brightest pixels in a heatmap, those that are not black and have no brighter neighbour
+// A pixel is a peak if it equals the maximum of the 3x3 block around it. The heatmap is treated as one long
+// row: the maximum is computed first down the columns, which relies on the black rows kept either side of the
+// heatmap, and then across, after which the first and last pixel of each row are redone without the pixel
+// that wrapped around from the neighbouring row. The result holds one bit per pixel in row-major order.
+GEOMETRY_INLINE void column_max_default(const uint8_t *heatmap, uint8_t *column_max, int width, int height, int i) {
+  const int size = width * height;
+#ifdef __SSE2__
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_max_epu8(_mm_loadu_si128((const __m128i *)(heatmap - width + i)), _mm_loadu_si128((const __m128i *)(heatmap + i)));
+    v = _mm_max_epu8(v, _mm_loadu_si128((const __m128i *)(heatmap + width + i)));
+    _mm_storeu_si128((__m128i *)(column_max + i), v);
+  }
+#endif
+  for (; i < size; i++) {
+    uint8_t v = heatmap[i - width] > heatmap[i] ? heatmap[i - width] : heatmap[i];
+    column_max[i] = v > heatmap[i + width] ? v : heatmap[i + width];
+  }
+}
+
+GEOMETRY_INLINE void peak_mask_default(const uint8_t *heatmap, const uint8_t *column_max, uint64_t *peaks, int width, int height, int i) {
+  const int size = width * height;
+#ifdef __SSE2__
+  for (; i + 16 <= size; i += 16) {
+    __m128i m = _mm_max_epu8(_mm_loadu_si128((const __m128i *)(column_max - 1 + i)), _mm_loadu_si128((const __m128i *)(column_max + i)));
+    m = _mm_max_epu8(m, _mm_loadu_si128((const __m128i *)(column_max + 1 + i)));
+    __m128i v = _mm_loadu_si128((const __m128i *)(heatmap + i));
+    __m128i peak = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()), _mm_cmpeq_epi8(v, m));
+    peaks[i / 64] |= (uint64_t)_mm_movemask_epi8(peak) << (i % 64);
+  }
+#endif
+  for (; i < size; i++) {
+    uint8_t m = column_max[i - 1] > column_max[i] ? column_max[i - 1] : column_max[i];
+    if (column_max[i + 1] > m) m = column_max[i + 1];
+    if (heatmap[i] != 0 && heatmap[i] == m) peaks[i / 64] |= 1ull << (i % 64);
+  }
+}
+
+// Redo the first and last pixel of each row, whose maximum took in a pixel from the next or previous row
+GEOMETRY_INLINE void peak_mask_edges(const uint8_t *heatmap, const uint8_t *column_max, uint64_t *peaks, int width, int height) {
+  for (int y = 0; y < height; y++) {
+    for (int edge = 0; edge < 2; edge++) {
+      int i = y * width + (edge ? width - 1 : 0);
+      uint8_t m = column_max[i];
+      if (width > 1 && column_max[edge ? i - 1 : i + 1] > m) m = column_max[edge ? i - 1 : i + 1];
+      peaks[i / 64] &= ~(1ull << (i % 64));
+      if (heatmap[i] != 0 && heatmap[i] == m) peaks[i / 64] |= 1ull << (i % 64);
+    }
+  }
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_avx2 GEOMETRY_INLINE void column_max_avx2(const uint8_t *heatmap, uint8_t *column_max, int width, int height, int i) {
+  const int size = width * height;
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_max_epu8(_mm256_loadu_si256((const __m256i *)(heatmap - width + i)), _mm256_loadu_si256((const __m256i *)(heatmap + i)));
+    v = _mm256_max_epu8(v, _mm256_loadu_si256((const __m256i *)(heatmap + width + i)));
+    _mm256_storeu_si256((__m256i *)(column_max + i), v);
+  }
+  column_max_default(heatmap, column_max, width, height, i);
+}
+
+TARGET_avx2 GEOMETRY_INLINE void peak_mask_avx2(const uint8_t *heatmap, const uint8_t *column_max, uint64_t *peaks, int width, int height, int i) {
+  const int size = width * height;
+  for (; i + 32 <= size; i += 32) {
+    __m256i m = _mm256_max_epu8(_mm256_loadu_si256((const __m256i *)(column_max - 1 + i)), _mm256_loadu_si256((const __m256i *)(column_max + i)));
+    m = _mm256_max_epu8(m, _mm256_loadu_si256((const __m256i *)(column_max + 1 + i)));
+    __m256i v = _mm256_loadu_si256((const __m256i *)(heatmap + i));
+    __m256i peak = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()), _mm256_cmpeq_epi8(v, m));
+    peaks[i / 64] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(peak) << (i % 64);
+  }
+  peak_mask_default(heatmap, column_max, peaks, width, height, i);
+}
+
+TARGET_avx512 GEOMETRY_INLINE void column_max_avx512(const uint8_t *heatmap, uint8_t *column_max, int width, int height, int i) {
+  const int size = width * height;
+  for (; i + 64 <= size; i += 64) {
+    __m512i v = _mm512_max_epu8(_mm512_loadu_si512((const void *)(heatmap - width + i)), _mm512_loadu_si512((const void *)(heatmap + i)));
+    v = _mm512_max_epu8(v, _mm512_loadu_si512((const void *)(heatmap + width + i)));
+    _mm512_storeu_si512((void *)(column_max + i), v);
+  }
+  column_max_avx2(heatmap, column_max, width, height, i);
+}
+
+TARGET_avx512 GEOMETRY_INLINE void peak_mask_avx512(const uint8_t *heatmap, const uint8_t *column_max, uint64_t *peaks, int width, int height, int i) {
+  const int size = width * height;
+  for (; i + 64 <= size; i += 64) {
+    __m512i m = _mm512_max_epu8(_mm512_loadu_si512((const void *)(column_max - 1 + i)), _mm512_loadu_si512((const void *)(column_max + i)));
+    m = _mm512_max_epu8(m, _mm512_loadu_si512((const void *)(column_max + 1 + i)));
+    __m512i v = _mm512_loadu_si512((const void *)(heatmap + i));
+    peaks[i / 64] = _mm512_test_epi8_mask(v, v) & _mm512_cmpeq_epi8_mask(v, m);
+  }
+  peak_mask_avx2(heatmap, column_max, peaks, width, height, i);
+}
+#endif
+
+// Offset of the top of a parabola through three evenly spaced values, in 1 / 2^SUBPIXEL_BITS pixels
+// The result is limited to half a pixel either way, so the peak stays within the centre sample.
+int parabola_offset(int left, int centre, int right) {
+  const int half = 1 << (SUBPIXEL_BITS - 1);
+  int curvature = left - 2 * centre + right;
+  if (curvature >= 0) return 0;
+  int offset = (left - right) * half / curvature;
+  return offset > half ? half : offset < -half ? -half : offset;
+}
+
+// Estimate the centre of a touch to a fraction of a pixel by fitting a parabola along each axis of the 3x3 block
+// around its brightest pixel
+// The axes are fitted separately, x through the sums of the block's columns and y through the sums of its rows,
+// so unlike a full 2-D quadratic fit the result ignores any tilt of the touch. Pixels outside the heatmap count
+// as black. The result is in 1 / 2^SUBPIXEL_BITS pixels, measured from the heatmap's corner like
+// pixel centres at (x + 0.5, y + 0.5).
+GEOMETRY_INLINE void subpixel_peak(const uint8_t *heatmap, int x, int y, int *centre_x, int *centre_y, int width, int height) {
+  int columns[3] = {0, 0, 0};
+  int rows[3] = {0, 0, 0};
+  for (int dy = -1; dy <= 1; dy++) {
+    if (y + dy < 0 || y + dy >= height) continue;
+    for (int dx = -1; dx <= 1; dx++) {
+      if (x + dx < 0 || x + dx >= width) continue;
+      int value = heatmap[(y + dy) * width + x + dx];
+      columns[dx + 1] += value;
+      rows[dy + 1] += value;
+    }
+  }
+  *centre_x = (x << SUBPIXEL_BITS) + (1 << (SUBPIXEL_BITS - 1)) + parabola_offset(columns[0], columns[1], columns[2]);
+  *centre_y = (y << SUBPIXEL_BITS) + (1 << (SUBPIXEL_BITS - 1)) + parabola_offset(rows[0], rows[1], rows[2]);
+}
+
+// Value-weighted moments of a cluster's pixels, up to the second
+// Heatmap values are at most 255 - HEATMAP_THRESHOLD, so the moments of a whole heatmap fit in 32 bits.
+struct moments {
+  uint32_t sum;
+  uint32_t sum_x;
+  uint32_t sum_y;
+  uint32_t sum_xx;
+  uint32_t sum_xy;
+  uint32_t sum_yy;
+};
+
+// Add up the moments of a cluster's pixels from pixel j onwards
+// The vector variants gather values through the heatmap indices, and find each pixel's row by multiplying by a
+// fixed point reciprocal of the width, which is exact for any index within a heatmap.
+GEOMETRY_INLINE void cluster_moments_default(const uint8_t *heatmap, const uint16_t *pixels, int count, struct moments *moments, int width, int j) {
+  for (; j < count; j++) {
+    int value = heatmap[pixels[j]];
+    int x = pixels[j] % width;
+    int y = pixels[j] / width;
+    moments->sum += value;
+    moments->sum_x += x * value;
+    moments->sum_y += y * value;
+    moments->sum_xx += x * x * value;
+    moments->sum_xy += x * y * value;
+    moments->sum_yy += y * y * value;
+  }
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_avx2 GEOMETRY_INLINE uint32_t sum_epi32_avx2(__m256i v) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s);
+}
+
+TARGET_avx2 GEOMETRY_INLINE void cluster_moments_avx2(const uint8_t *heatmap, const uint16_t *pixels, int count, struct moments *moments, int width, int j) {
+  const __m256i reciprocal = _mm256_set1_epi32(((1 << 22) + width - 1) / width);
+  const __m256i widths = _mm256_set1_epi32(width);
+  const __m256i low_byte = _mm256_set1_epi32(0xff);
+  __m256i sum = _mm256_setzero_si256();
+  __m256i sum_x = _mm256_setzero_si256();
+  __m256i sum_y = _mm256_setzero_si256();
+  __m256i sum_xx = _mm256_setzero_si256();
+  __m256i sum_xy = _mm256_setzero_si256();
+  __m256i sum_yy = _mm256_setzero_si256();
+  for (; j + 8 <= count; j += 8) {
+    __m256i index = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(pixels + j)));
+    // Each gather reads four bytes, which stays within the black row after the heatmap
+    __m256i value = _mm256_and_si256(_mm256_i32gather_epi32((const int *)heatmap, index, 1), low_byte);
+    __m256i y = _mm256_srli_epi32(_mm256_mullo_epi32(index, reciprocal), 22);
+    __m256i x = _mm256_sub_epi32(index, _mm256_mullo_epi32(y, widths));
+    __m256i value_x = _mm256_mullo_epi32(x, value);
+    __m256i value_y = _mm256_mullo_epi32(y, value);
+    sum = _mm256_add_epi32(sum, value);
+    sum_x = _mm256_add_epi32(sum_x, value_x);
+    sum_y = _mm256_add_epi32(sum_y, value_y);
+    sum_xx = _mm256_add_epi32(sum_xx, _mm256_mullo_epi32(x, value_x));
+    sum_xy = _mm256_add_epi32(sum_xy, _mm256_mullo_epi32(y, value_x));
+    sum_yy = _mm256_add_epi32(sum_yy, _mm256_mullo_epi32(y, value_y));
+  }
+  moments->sum += sum_epi32_avx2(sum);
+  moments->sum_x += sum_epi32_avx2(sum_x);
+  moments->sum_y += sum_epi32_avx2(sum_y);
+  moments->sum_xx += sum_epi32_avx2(sum_xx);
+  moments->sum_xy += sum_epi32_avx2(sum_xy);
+  moments->sum_yy += sum_epi32_avx2(sum_yy);
+  cluster_moments_default(heatmap, pixels, count, moments, width, j);
+}
+
+TARGET_avx512 GEOMETRY_INLINE void cluster_moments_avx512(const uint8_t *heatmap, const uint16_t *pixels, int count, struct moments *moments, int width, int j) {
+  const __m512i reciprocal = _mm512_set1_epi32(((1 << 22) + width - 1) / width);
+  const __m512i widths = _mm512_set1_epi32(width);
+  const __m512i low_byte = _mm512_set1_epi32(0xff);
+  __m512i sum = _mm512_setzero_si512();
+  __m512i sum_x = _mm512_setzero_si512();
+  __m512i sum_y = _mm512_setzero_si512();
+  __m512i sum_xx = _mm512_setzero_si512();
+  __m512i sum_xy = _mm512_setzero_si512();
+  __m512i sum_yy = _mm512_setzero_si512();
+  for (; j + 16 <= count; j += 16) {
+    __m512i index = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(pixels + j)));
+    __m512i value = _mm512_and_si512(_mm512_i32gather_epi32(index, (const int *)heatmap, 1), low_byte);
+    __m512i y = _mm512_srli_epi32(_mm512_mullo_epi32(index, reciprocal), 22);
+    __m512i x = _mm512_sub_epi32(index, _mm512_mullo_epi32(y, widths));
+    __m512i value_x = _mm512_mullo_epi32(x, value);
+    __m512i value_y = _mm512_mullo_epi32(y, value);
+    sum = _mm512_add_epi32(sum, value);
+    sum_x = _mm512_add_epi32(sum_x, value_x);
+    sum_y = _mm512_add_epi32(sum_y, value_y);
+    sum_xx = _mm512_add_epi32(sum_xx, _mm512_mullo_epi32(x, value_x));
+    sum_xy = _mm512_add_epi32(sum_xy, _mm512_mullo_epi32(y, value_x));
+    sum_yy = _mm512_add_epi32(sum_yy, _mm512_mullo_epi32(y, value_y));
+  }
+  moments->sum += _mm512_reduce_add_epi32(sum);
+  moments->sum_x += _mm512_reduce_add_epi32(sum_x);
+  moments->sum_y += _mm512_reduce_add_epi32(sum_y);
+  moments->sum_xx += _mm512_reduce_add_epi32(sum_xx);
+  moments->sum_xy += _mm512_reduce_add_epi32(sum_xy);
+  moments->sum_yy += _mm512_reduce_add_epi32(sum_yy);
+  cluster_moments_avx2(heatmap, pixels, count, moments, width, j);
+}
+#endif
+
+// Minimum and maximum of two floats
+// These compile to single instructions, where fminf and fmaxf are libm calls unless NaNs are ruled out. A NaN
+// in a gives b, as it does with fminf and fmaxf.
+float min_float(float a, float b) {
+  return a < b ? a : b;
+}
+
+float max_float(float a, float b) {
+  return a > b ? a : b;
+}
+
+// Angle of (x, y) from the X axis in degrees, without calling atan2f
+// The arctangent of the smaller magnitude over the larger is a polynomial on [0, 1], accurate to a thousandth of
+// a degree, and the quadrant is then put back with selects rather than branches.
+float atan2_degrees(float y, float x) {
+  float ax = fabsf(x);
+  float ay = fabsf(y);
+  float largest = max_float(ax, ay);
+  float z = largest > 0 ? min_float(ax, ay) / largest : 0;
+  float z2 = z * z;
+  float angle = z * (0.9998660f + z2 * (-0.3302995f + z2 * (0.1801410f + z2 * (-0.0851330f + z2 * 0.0208351f))));
+  angle = ay > ax ? (float)M_PI_2 - angle : angle;
+  angle = x < 0 ? (float)M_PI - angle : angle;
+  angle = y < 0 ? -angle : angle;
+  return angle * (180 / (float)M_PI);
+}
+
+// Fit an ellipse to a cluster from its second moments
+// The ellipse is the uniform one with the same covariance as the cluster, whose axes are four standard
+// deviations long along the eigenvectors of the covariance. Each pixel is a square rather than a point, which
+// adds 1/12 to the variance along x and y, so a single pixel gives a circle one pixel across. orientation is
+// the angle of the major axis in degrees clockwise from the Y axis, between -90 and 90 as uinput expects.
+void fit_ellipse(const struct moments *moments, float *major, float *minor, float *orientation) {
+  float mean_x = (float)moments->sum_x / moments->sum;
+  float mean_y = (float)moments->sum_y / moments->sum;
+  float xx = (float)moments->sum_xx / moments->sum - mean_x * mean_x + 1 / 12.f;
+  float xy = (float)moments->sum_xy / moments->sum - mean_x * mean_y;
+  float yy = (float)moments->sum_yy / moments->sum - mean_y * mean_y + 1 / 12.f;
+  float half_trace = (xx + yy) / 2;
+  float spread = sqrtf((xx - yy) * (xx - yy) / 4 + xy * xy);
+  *major = 4 * sqrtf(half_trace + spread);
+  *minor = 4 * sqrtf(max_float(half_trace - spread, 0));
+  // The major axis is at theta from the X axis, y pointing down
+  float theta = atan2_degrees(2 * xy, xx - yy) / 2;
+  *orientation = theta > 0 ? theta - 90 : theta + 90;
+}
+
+// Statistics of a connected component, gathered while it is labelled
+struct component {
+  struct moments moments;
+  uint16_t area;
+  // Heatmap index of the brightest pixel, the first one in row-major order if there are several
+  uint16_t peak;
+};
+
+// Offsets of the neighbours of a pixel that come before it in row-major order
+const int8_t scanned_dx[4] = {-1, -1, 0, 1};
+const int8_t scanned_dy[4] = {0, -1, -1, -1};
+
+// Find the root of a label, pointing every label on the way straight at it
+GEOMETRY_INLINE int find_root(uint16_t *parent, int label) {
+  int root = label;
+  while (parent[root] != root) root = parent[root];
+  while (parent[label] != root) {
+    int next = parent[label];
+    parent[label] = root;
+    label = next;
+  }
+  return root;
+}
+
+// Split the heatmap into its connected components in two row-major scans, gathering their statistics as it goes
+// The first scan gives each pixel that is not black the label of the pixels before it that it touches, or a
+// new one, and joins their labels in a union-find forest when it touches more than one. A set's root is always
+// its first label, and each pixel is added to the statistics of the root it was given. Between the scans each
+// label's statistics are added to its root's, and the roots numbered as clusters in the order they were first
+// seen, up to MAX_CLUSTERS. The second scan writes the label image and gathers each cluster's pixels, brightest
+// first. The number of clusters is returned, with their statistics in components.
+GEOMETRY_INLINE int connected_components(const uint8_t *heatmap, uint8_t *labels, struct cluster_group *cluster_group, uint16_t *pixels, struct component *components, int width, int height) {
+  uint16_t provisional[MAX_WIDTH * MAX_HEIGHT];
+  uint16_t parent[MAX_COMPONENTS + 1];
+  struct component stats[MAX_COMPONENTS + 1];
+  int count = 0;
+  parent[0] = 0;
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int i = y * width + x;
+      // Most of a heatmap is black, so step over it eight pixels at a time where it can
+      if (x + 8 <= width) {
+        uint64_t span;
+        memcpy(&span, heatmap + i, 8);
+        if (span == 0) {
+          memset(provisional + i, 0, sizeof(uint16_t) * 8);
+          x += 7;
+          continue;
+        }
+      }
+      int value = heatmap[i];
+      provisional[i] = 0;
+      if (value == 0) continue;
+
+      // Join the labels of the neighbours already scanned, left, and the three above
+      int label = 0;
+      for (int k = 0; k < 4; k++) {
+        int nx = x + scanned_dx[k];
+        int ny = y + scanned_dy[k];
+        if (nx < 0 || nx >= width || ny < 0) continue;
+        int n = provisional[ny * width + nx];
+        if (n == 0) continue;
+        int root = find_root(parent, n);
+        if (label == 0) {
+          label = root;
+        } else if (root < label) {
+          parent[label] = root;
+          label = root;
+        } else if (root > label) {
+          parent[root] = label;
+        }
+      }
+      if (label == 0) {
+        label = ++count;
+        parent[label] = label;
+        stats[label] = (struct component){{0, 0, 0, 0, 0, 0}, 0, i};
+      }
+      provisional[i] = label;
+
+      struct component *component = &stats[label];
+      component->area++;
+      component->moments.sum += value;
+      component->moments.sum_x += x * value;
+      component->moments.sum_y += y * value;
+      component->moments.sum_xx += x * x * value;
+      component->moments.sum_xy += x * y * value;
+      component->moments.sum_yy += y * y * value;
+      if (value > heatmap[component->peak]) component->peak = i;
+    }
+  }
+
+  // Fold each label into its root, roots come before the labels joined to them so they are already numbered
+  uint8_t cluster[MAX_COMPONENTS + 1];
+  int fill[MAX_CLUSTERS];
+  int clusters = 0;
+  cluster[0] = 0;
+  for (int l = 1; l <= count; l++) {
+    int root = find_root(parent, l);
+    if (root == l) {
+      cluster[l] = clusters < MAX_CLUSTERS ? ++clusters : 0;
+      continue;
+    }
+    cluster[l] = cluster[root];
+    struct component *from = &stats[l];
+    struct component *to = &stats[root];
+    to->area += from->area;
+    to->moments.sum += from->moments.sum;
+    to->moments.sum_x += from->moments.sum_x;
+    to->moments.sum_y += from->moments.sum_y;
+    to->moments.sum_xx += from->moments.sum_xx;
+    to->moments.sum_xy += from->moments.sum_xy;
+    to->moments.sum_yy += from->moments.sum_yy;
+    if (heatmap[from->peak] > heatmap[to->peak] || (heatmap[from->peak] == heatmap[to->peak] && from->peak < to->peak)) to->peak = from->peak;
+  }
+  for (int l = 1, offset = 0; l <= count; l++) {
+    if (parent[l] != l || cluster[l] == 0) continue;
+    int n = cluster[l] - 1;
+    components[n] = stats[l];
+    cluster_group->offset[n] = offset;
+    cluster_group->count[n] = stats[l].area;
+    pixels[offset] = stats[l].peak;
+    fill[n] = offset + 1;
+    offset += stats[l].area;
+  }
+
+  for (int i = 0; i < width * height; i++) {
+    int n = cluster[provisional[i]];
+    labels[i] = n;
+    if (n && i != components[n - 1].peak) pixels[fill[n - 1]++] = i;
+  }
+  return clusters;
+}
+
+// Invalidate the smaller of each pair of valid clusters whose boxes overlap by more than a quarter of it
+// Rather than testing every pair, the clusters are sorted by their left edges and swept from left to right,
+// keeping a list of the boxes still open. Only boxes that meet on both axes are paired, so the work grows with
+// the number of clusters and of overlapping pairs rather than with its square. Each cluster keeps a bitmap of
+// the later clusters it overlaps, and the pairs are tested in the same order a loop over every pair would
+// take, so a cluster invalidated by one pair is not then used to invalidate another.
+_Static_assert(MAX_CLUSTERS <= 64, "overlapping pairs are kept in a 64 bit mask per cluster");
+void remove_overlaps(struct cluster_group *cluster_group) {
+  const float *x1 = cluster_group->x1;
+  const float *y1 = cluster_group->y1;
+  const float *x2 = cluster_group->x2;
+  const float *y2 = cluster_group->y2;
+  uint8_t *valid = cluster_group->valid;
+  uint8_t order[MAX_CLUSTERS];
+  uint8_t open[MAX_CLUSTERS];
+  uint64_t pairs[MAX_CLUSTERS];
+  int count = 0;
+  int open_count = 0;
+
+  // Sort the valid clusters by left edge, there are few enough for an insertion sort
+  for (int i = 0; i < cluster_group->size; i++) {
+    pairs[i] = 0;
+    if (!valid[i]) continue;
+    int j = count++;
+    for (; j > 0 && x1[order[j - 1]] > x1[i]; j--) order[j] = order[j - 1];
+    order[j] = i;
+  }
+
+  // Pair each cluster with the open boxes it meets, closing those that end before it starts
+  for (int k = 0; k < count; k++) {
+    int i = order[k];
+    for (int o = 0; o < open_count;) {
+      int j = open[o];
+      if (x2[j] <= x1[i]) {
+        open[o] = open[--open_count];
+        continue;
+      }
+      if (min_float(y2[i], y2[j]) > max_float(y1[i], y1[j])) pairs[i < j ? i : j] |= 1ull << (i < j ? j : i);
+      o++;
+    }
+    open[open_count++] = i;
+  }
+
+  for (int i = 0; i < cluster_group->size; i++) {
+    for (uint64_t mask = pairs[i]; mask && valid[i]; mask &= mask - 1) {
+      int j = __builtin_ctzll(mask);
+      if (!valid[j]) continue;
+      // Calculate the intersection of the pair, and the area of each cluster in it
+      float intersection = (min_float(x2[i], x2[j]) - max_float(x1[i], x1[j])) * (min_float(y2[i], y2[j]) - max_float(y1[i], y1[j]));
+      float area_i = (x2[i] - x1[i]) * (y2[i] - y1[i]);
+      float area_j = (x2[j] - x1[j]) * (y2[j] - y1[j]);
+      // If the intersection is greater than 25% of the smaller cluster, invalidate it
+      if (area_i > area_j) {
+        if (intersection / area_j > 0.25f) valid[j] = 0;
+      } else {
+        if (intersection / area_i > 0.25f) valid[i] = 0;
+      }
+    }
+  }
+}
+
+// Solve a square assignment problem with the Hungarian algorithm
+// cost is an n by n row-major matrix. On return, assignment[row] is the column paired with each row, chosen so
+// the total cost is as small as possible. This runs in O(n^3) using row and column potentials.
+void solve_assignment(const float *cost, int n, int *assignment) {
+  float u[MAX_CLUSTERS + 1];
+  float v[MAX_CLUSTERS + 1];
+  float min_reduced[MAX_CLUSTERS + 1];
+  // Row matched to each column and the previous column on the augmenting path, index 0 is a virtual column
+  int match[MAX_CLUSTERS + 1];
+  int way[MAX_CLUSTERS + 1];
+  uint8_t used[MAX_CLUSTERS + 1];
+
+  for (int j = 0; j <= n; j++) {
+    u[j] = 0;
+    v[j] = 0;
+    match[j] = 0;
+  }
 
-  // Add the pixel to the cluster
-  cluster->pixels[cluster->size++] = pixels[y * WIDTH + x];
+  // Add rows one at a time, growing a shortest augmenting path from each
+  for (int i = 1; i <= n; i++) {
+    match[0] = i;
+    int j0 = 0;
+    for (int j = 0; j <= n; j++) {
+      min_reduced[j] = INFINITY;
+      used[j] = 0;
+    }
+    do {
+      used[j0] = 1;
+      int i0 = match[j0];
+      int j1 = 0;
+      float delta = INFINITY;
+      for (int j = 1; j <= n; j++) {
+        if (used[j]) continue;
+        float reduced = cost[(i0 - 1) * n + j - 1] - u[i0] - v[j];
+        if (reduced < min_reduced[j]) {
+          min_reduced[j] = reduced;
+          way[j] = j0;
+        }
+        if (min_reduced[j] < delta) {
+          delta = min_reduced[j];
+          j1 = j;
+        }
+      }
+      for (int j = 0; j <= n; j++) {
+        if (used[j]) {
+          u[match[j]] += delta;
+          v[j] -= delta;
+        } else {
+          min_reduced[j] -= delta;
+        }
+      }
+      j0 = j1;
+    } while (match[j0] != 0);
 
-  // Call this function recursively for the surrounding pixels if they are within the image bounds
-  if (x > 0) {
-    if (y > 0) assign_group_dimmer(pixels, x - 1, y - 1, cluster, pixels[y * WIDTH + x].value);
-    assign_group_dimmer(pixels, x - 1, y, cluster, pixels[y * WIDTH + x].value);
-    if (y < HEIGHT - 1) assign_group_dimmer(pixels, x - 1, y + 1, cluster, pixels[y * WIDTH + x].value);
+    // Flip the matches along the path
+    do {
+      int j1 = way[j0];
+      match[j0] = match[j1];
+      j0 = j1;
+    } while (j0 != 0);
   }
-  if (y > 0) assign_group_dimmer(pixels, x, y - 1, cluster, pixels[y * WIDTH + x].value);
-  if (y < HEIGHT - 1) assign_group_dimmer(pixels, x, y + 1, cluster, pixels[y * WIDTH + x].value);
-  if (x < WIDTH - 1) {
-    if (y > 0) assign_group_dimmer(pixels, x + 1, y - 1, cluster, pixels[y * WIDTH + x].value);
-    assign_group_dimmer(pixels, x + 1, y, cluster, pixels[y * WIDTH + x].value);
-    if (y < HEIGHT - 1) assign_group_dimmer(pixels, x + 1, y + 1, cluster, pixels[y * WIDTH + x].value);
+
+  for (int j = 1; j <= n; j++) {
+    assignment[match[j] - 1] = j - 1;
   }
 }
 
-// Identify whether a pixel is brighter than all its neighbours
-int is_brightest(struct pixel *pixels, int x, int y) {
-  if (pixels[y * WIDTH + x].value == 0) return 0;
-  if (x > 0) {
-    if (y > 0 && pixels[y * WIDTH + x].value < pixels[y * WIDTH - WIDTH + x - 1].value) return 0;
-    if (pixels[y * WIDTH + x].value < pixels[y * WIDTH + x - 1].value) return 0;
-    if (y < HEIGHT - 1 && pixels[y * WIDTH + x].value < pixels[y * WIDTH + WIDTH + x - 1].value) return 0;
+// Constant velocity Kalman filter following one touch
+// The x and y axes are filtered independently but see the same intervals and noise, so they share one
+// covariance matrix, of which only the upper triangle is kept.
+struct touch_filter {
+  uint8_t active;
+  float x;
+  float y;
+  float vx;
+  float vy;
+  float p00;
+  float p01;
+  float p11;
+};
+
+// Start following a touch from its first position, with no velocity
+void touch_filter_reset(struct touch_filter *filter, float x, float y) {
+  filter->active = 1;
+  filter->x = x;
+  filter->y = y;
+  filter->vx = 0;
+  filter->vy = 0;
+  filter->p00 = PREDICT_MEASUREMENT_NOISE;
+  filter->p01 = 0;
+  filter->p11 = PREDICT_VELOCITY_NOISE;
+}
+
+// Advance a filter by dt seconds and correct it with a measured position
+void touch_filter_update(struct touch_filter *filter, float x, float y, float dt) {
+  // Predict, with process noise from a random acceleration over the interval
+  float q = PREDICT_PROCESS_NOISE;
+  filter->x += filter->vx * dt;
+  filter->y += filter->vy * dt;
+  filter->p00 += dt * (2 * filter->p01 + dt * filter->p11) + q * dt * dt * dt / 3;
+  filter->p01 += dt * filter->p11 + q * dt * dt / 2;
+  filter->p11 += q * dt;
+
+  // Correct towards the measurement in proportion to how much each is trusted
+  float k0 = filter->p00 / (filter->p00 + PREDICT_MEASUREMENT_NOISE);
+  float k1 = filter->p01 / (filter->p00 + PREDICT_MEASUREMENT_NOISE);
+  float error_x = x - filter->x;
+  float error_y = y - filter->y;
+  filter->x += k0 * error_x;
+  filter->y += k0 * error_y;
+  filter->vx += k1 * error_x;
+  filter->vy += k1 * error_y;
+  filter->p11 -= k1 * filter->p01;
+  filter->p00 -= k0 * filter->p00;
+  filter->p01 -= k0 * filter->p01;
+}
+
+// Single-producer, single-consumer ring of fixed-size slots
+// The producer fills the slot returned by ring_reserve and publishes it with ring_commit. The consumer reads
+// the slot returned by ring_peek and hands it back with ring_release. Neither side locks or waits, a full or
+// empty ring is reported as NULL. head and tail live on separate cache lines so the two sides don't contend.
+struct ring {
+  _Alignas(64) _Atomic uint32_t head;
+  _Alignas(64) _Atomic uint32_t tail;
+  _Alignas(64) uint32_t mask;
+  size_t slot_size;
+  uint8_t *slots;
+};
+
+// Allocate a ring, size must be a power of two
+void ring_init(struct ring *ring, uint32_t size, size_t slot_size) {
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->mask = size - 1;
+  ring->slot_size = slot_size;
+  ring->slots = calloc(size, slot_size);
+}
+
+void *ring_reserve(struct ring *ring) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) > ring->mask) return NULL;
+  return ring->slots + (size_t)(head & ring->mask) * ring->slot_size;
+}
+
+void ring_commit(struct ring *ring) {
+  atomic_store_explicit(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + 1, memory_order_release);
+}
+
+void *ring_peek(struct ring *ring) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) return NULL;
+  return ring->slots + (size_t)(tail & ring->mask) * ring->slot_size;
+}
+
+void ring_release(struct ring *ring) {
+  atomic_store_explicit(&ring->tail, atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1, memory_order_release);
+}
+
+// A ring plus an eventfd used to wake its consumer
+// The consumer sets sleeping before it blocks, and the producer only pays for the eventfd write when it does.
+struct channel {
+  struct ring ring;
+  _Atomic int sleeping;
+  int wakeup;
+};
+
+void channel_init(struct channel *channel, uint32_t size, size_t slot_size) {
+  ring_init(&channel->ring, size, slot_size);
+  atomic_init(&channel->sleeping, 0);
+  channel->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+void channel_wake(struct channel *channel) {
+  uint64_t one = 1;
+  write(channel->wakeup, &one, sizeof(one));
+}
+
+// Publish the reserved slot and wake the consumer if it is waiting for one
+void channel_commit(struct channel *channel) {
+  ring_commit(&channel->ring);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&channel->sleeping, memory_order_relaxed)) channel_wake(channel);
+}
+
+// Announce that the consumer is about to block on channel->wakeup
+// Returns 0 if something arrived in the meantime and it should not block. Either way, call channel_wait_done
+// once it is awake again.
+int channel_wait_begin(struct channel *channel) {
+  atomic_store_explicit(&channel->sleeping, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  return ring_peek(&channel->ring) == NULL;
+}
+
+void channel_wait_done(struct channel *channel) {
+  uint64_t count;
+  atomic_store_explicit(&channel->sleeping, 0, memory_order_relaxed);
+  read(channel->wakeup, &count, sizeof(count));
+}
+
+// Events queued for one uinput device
+// A frame's events are collected here and written to the device with a single syscall, rather than one
+// write per event. Events the device does not accept straight away stay queued until it is writable again.
+struct event_batch {
+  int fd;
+  int count;
+  // Set while the event loop is waiting for the device to become writable
+  uint8_t waiting;
+  // Number of frames thrown away because the device was not accepting events
+  uint64_t dropped;
+  // When set, flushed events are passed to the emitter thread instead of being written here
+  struct channel *channel;
+  struct input_event events[MAX_BATCH_EVENTS];
+};
+
+// Events flushed by the processor thread for the emitter thread to write
+struct queued_events {
+  int fd;
+  int count;
+  struct input_event events[MAX_BATCH_EVENTS];
+};
+
+// Hand all queued events over to the emitter thread
+// If the emitter is that far behind, the events are dropped rather than holding up processing.
+void queue_events(struct event_batch *batch) {
+  struct queued_events *queued = ring_reserve(&batch->channel->ring);
+  if (queued) {
+    queued->fd = batch->fd;
+    queued->count = batch->count;
+    memcpy(queued->events, batch->events, sizeof(struct input_event) * batch->count);
+    channel_commit(batch->channel);
+  } else {
+    batch->dropped++;
   }
-  if (y > 0 && pixels[y * WIDTH + x].value < pixels[y * WIDTH - WIDTH + x].value) return 0;
-  if (y < HEIGHT - 1 && pixels[y * WIDTH + x].value < pixels[y * WIDTH + WIDTH + x].value) return 0;
-  if (x < WIDTH - 1) {
-    if (y > 0 && pixels[y * WIDTH + x].value < pixels[y * WIDTH - WIDTH + x + 1].value) return 0;
-    if (pixels[y * WIDTH + x].value < pixels[y * WIDTH + x + 1].value) return 0;
-    if (y < HEIGHT - 1 && pixels[y * WIDTH + x].value < pixels[y * WIDTH + WIDTH + x + 1].value) return 0;
+  batch->count = 0;
+}
+
+// Write as many queued events as the device accepts
+// Returns 1 if events are still queued because the device would block, 0 once the batch is empty.
+int flush_events(struct event_batch *batch) {
+  if (batch->channel && batch->count > 0) queue_events(batch);
+  while (batch->count > 0) {
+    ssize_t n = write(batch->fd, batch->events, sizeof(struct input_event) * batch->count);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return 1;
+      // The device is gone or broken, there is nothing useful to do with the events
+      perror("Error writing events");
+      batch->count = 0;
+      return 0;
+    }
+    // uinput consumes whole events, keep whatever was not taken
+    int written = n / sizeof(struct input_event);
+    batch->count -= written;
+    memmove(batch->events, batch->events + written, sizeof(struct input_event) * batch->count);
   }
+  return 0;
+}
 
-  return 1;
+// Make room in a full batch by discarding its oldest frame
+// Every frame carries the complete state of the device, so a newer frame replaces an older one without loss.
+void drop_oldest_frame(struct event_batch *batch) {
+  int end = 0;
+  while (end < batch->count && !(batch->events[end].type == EV_SYN && batch->events[end].code == SYN_REPORT)) end++;
+  end = end < batch->count ? end + 1 : batch->count;
+  batch->count -= end;
+  memmove(batch->events, batch->events + end, sizeof(struct input_event) * batch->count);
+  batch->dropped++;
 }
 
-void emit(int fd, int type, int code, int val) {
-  struct input_event ie;
+// Make room for count more events in a batch and return a pointer to the first of them
+// The caller must fill in every event it asked for.
+struct input_event *reserve_events(struct event_batch *batch, int count) {
+  while (batch->count + count > MAX_BATCH_EVENTS) {
+    if (flush_events(batch)) drop_oldest_frame(batch);
+  }
+  struct input_event *ie = &batch->events[batch->count];
+  batch->count += count;
+  return ie;
+}
 
-  ie.type = type;
-  ie.code = code;
-  ie.value = val;
+void set_event(struct input_event *ie, int type, int code, int val) {
+  ie->type = type;
+  ie->code = code;
+  ie->value = val;
   /* timestamp values below are ignored */
-  ie.time.tv_sec = 0;
-  ie.time.tv_usec = 0;
+  ie->time.tv_sec = 0;
+  ie->time.tv_usec = 0;
+}
 
-  write(fd, &ie, sizeof(ie));
+// Queue an event, it is sent on the next flush_events
+void emit(struct event_batch *batch, int type, int code, int val) {
+  set_event(reserve_events(batch, 1), type, code, val);
 }
 
-int main() {
-  // Initialize SDL for testing
-  // SDL_Init(SDL_INIT_VIDEO);
-  // TTF_Init();
-  // SDL_Event event;
-  // SDL_Window *win = SDL_CreateWindow("Tablet", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH * SCALE, HEIGHT * SCALE, 0);
-  // SDL_Renderer *ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-  // SDL_Texture *tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WIDTH * SCALE, HEIGHT * SCALE);
-  // TTF_Font *font = TTF_OpenFont("OpenSans-Regular.ttf", 24);
+// Stylus elements waiting to be printed by the log thread
+struct stylus_log_entry {
+  // Set on the first element of each report
+  uint8_t first;
+  uint32_t serial;
+  struct ipts_stylus_element element;
+};
+
+struct stylus_log {
+  struct ring ring;
+  pthread_t thread;
+  _Atomic int stop;
+  // Entries lost because the log thread fell behind
+  uint64_t dropped;
+};
+
+// Print logged stylus elements until asked to stop, then print whatever is left
+void *stylus_log_thread(void *arg) {
+  struct stylus_log *log = arg;
+  while (1) {
+    int stop = atomic_load(&log->stop);
+    struct stylus_log_entry *entry;
+    while ((entry = ring_peek(&log->ring))) {
+      if (entry->first) printf("Stylus data! Serial: %d\n", entry->serial);
+      printf("  Element: Mode: %02x, X: %d, Y: %d\n", entry->element.mode, entry->element.x, entry->element.y);
+      printf("    Pressure: %d, Altitude: %d, Azimuth: %d\n", entry->element.pressure, entry->element.altitude, entry->element.azimuth);
+      ring_release(&log->ring);
+    }
+    fflush(stdout);
+    if (stop) return NULL;
+    nanosleep(&(struct timespec){0, LOG_POLL_MS * 1000000L}, NULL);
+  }
+}
+
+struct stylus_log *start_stylus_log() {
+  struct stylus_log *log = calloc(1, sizeof(struct stylus_log));
+  ring_init(&log->ring, STYLUS_LOG_SIZE, sizeof(struct stylus_log_entry));
+  pthread_create(&log->thread, NULL, stylus_log_thread, log);
+  return log;
+}
+
+void stop_stylus_log(struct stylus_log *log) {
+  atomic_store(&log->stop, 1);
+  pthread_join(log->thread, NULL);
+}
+
+// Stages of the frame path that are timed individually
+enum stage {
+  STAGE_PARSE,
+  STAGE_TRANSFORM,
+  STAGE_PEAKS,
+  STAGE_CLUSTERS,
+  STAGE_BOUNDS,
+  STAGE_OVERLAP,
+  STAGE_TRACKING,
+  STAGE_EMIT,
+  STAGE_STYLUS,
+  STAGE_COUNT
+};
+
+const char *stage_names[STAGE_COUNT] = {"parse", "transform", "peaks", "clusters", "bounds", "overlap", "tracking", "emit", "stylus"};
+
+// Ways of finding the centre of a touch
+enum centroid {
+  // Value-weighted mean of all pixels in the cluster
+  CENTROID_MEAN,
+  // Quadratic fit around the brightest pixel, see subpixel_peak
+  CENTROID_PEAK,
+};
+
+// Ways of splitting the heatmap into clusters
+enum segment {
+  // Flood the whole heatmap from its peaks, see watershed
+  SEGMENT_WATERSHED,
+  // Grow a cluster downhill from each peak, see assign_group_dimmer, then remove the ones that overlap
+  SEGMENT_FILL,
+  // Each connected area of pixels that are not black, see connected_components
+  SEGMENT_COMPONENTS,
+};
 
-  // Open uinput device
+// Distribution of a measured duration
+// Buckets are spaced logarithmically, with each power of two split into four, so a percentile read back is
+// within 25% of the true value while the histogram stays a fixed size.
+struct histogram {
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+int histogram_bucket(uint64_t value) {
+  if (value < 4) return value;
+  int exponent = 63 - __builtin_clzll(value);
+  int bucket = (exponent - 1) * 4 + ((value >> (exponent - 2)) & 3);
+  return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value that falls in a bucket
+uint64_t histogram_bucket_limit(int bucket) {
+  if (bucket < 4) return bucket;
+  int exponent = bucket / 4 + 1;
+  return ((uint64_t)(4 + bucket % 4 + 1) << (exponent - 2)) - 1;
+}
+
+void histogram_add(struct histogram *histogram, uint64_t value) {
+  histogram->buckets[histogram_bucket(value)]++;
+  histogram->count++;
+  histogram->total += value;
+  if (value > histogram->max) histogram->max = value;
+}
+
+// Estimate a percentile from the upper limit of the bucket it falls in
+uint64_t histogram_percentile(struct histogram *histogram, double p) {
+  uint64_t rank = (uint64_t)ceil(p * histogram->count);
+  uint64_t seen = 0;
+  for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+    seen += histogram->buckets[b];
+    if (seen >= rank && seen > 0) {
+      uint64_t limit = histogram_bucket_limit(b);
+      return limit < histogram->max ? limit : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+// A stylus position placed on the monotonic clock
+struct stylus_sample {
+  uint64_t time;
+  float x;
+  float y;
+  float pressure;
+  uint16_t mode;
+};
+
+// Resampling of stylus elements to the display's refresh
+// Output positions fall on a grid of period nanoseconds, offset by phase from multiples of the period on the
+// monotonic clock, which is the clock vblank events are timestamped with. Element timestamps are unwrapped
+// into ticks, and placed on the monotonic clock by offset, the earliest arrival seen for a tick count.
+struct stylus_resampler {
+  uint64_t period;
+  uint64_t phase;
+  uint64_t ticks;
+  int64_t offset;
+  // Whether the pen is in proximity, its last two samples, and the time of the last position written
+  uint8_t tracking;
+  struct stylus_sample previous;
+  struct stylus_sample last;
+  uint64_t output;
+};
+
+struct geometry;
+struct capture_writer;
+
+// State carried between frames
+struct ipts_state {
+  struct event_batch touch_events;
+  struct event_batch stylus_events;
+  uint8_t *heatmap;
+  struct cluster_group *cluster_groups;
+  int current_cluster_group;
+  // Pixels of the current heatmap's clusters, indexed by each cluster's offset, and the cluster of each pixel
+  // when they are found by watershed or as components
+  uint16_t *cluster_pixels;
+  uint8_t *labels;
+  // Geometry of the last heatmap, and the instruction set its kernels are run with
+  const struct geometry *geometry;
+  enum isa isa;
+  enum centroid centroid;
+  enum segment segment;
+  // Stylus resampling, see resample_stylus
+  struct stylus_resampler stylus_resampler;
+  // How far ahead to predict touch positions in seconds, 0 to emit them as measured, and a filter per ID
+  float predict;
+  struct touch_filter touch_filters[MAX_CLUSTERS + 1];
+  // Optional log of stylus elements, printed from a background thread
+  struct stylus_log *stylus_log;
+  // Optional capture that frames are recorded to, written by whichever thread reads them
+  struct capture_writer *capture;
+  // Time the last heatmap was processed, and whether it left any touches down
+  uint64_t last_heatmap_ns;
+  // Time the current frame was read, given by replay from the capture so that it is processed the same way
+  // however long replaying takes, or 0 to read the clock. Raw captures have no times, so their frames are
+  // counted in nominal periods and their heatmaps are taken to arrive one nominal period apart.
+  uint64_t frame_ns;
+  int nominal_period;
+  // Range of the touch device, which touch positions are scaled to fill, or 0 to scale every heatmap pixel to
+  // SCALE units as replays do
+  int touch_max_x;
+  int touch_max_y;
+  int touching;
+  // Frames dropped because their headers did not fit inside them
+  uint64_t malformed_frames;
+  // Number of frames processed and the time spent in each stage and whole frames, in clock ticks
+  uint64_t frames;
+  struct histogram stages[STAGE_COUNT];
+  struct histogram frame_time;
+  // Ticks spent in each stage during the current frame, and which stages ran
+  uint64_t frame_ticks[STAGE_COUNT];
+  uint32_t frame_stages;
+  // Clock readings taken together at startup, used to convert ticks to nanoseconds
+  uint64_t start_ticks;
+  uint64_t start_ns;
+};
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Read the cheapest clock available for timing stages
+// This is the TSC on x86, which costs a few cycles rather than a vDSO call, and nanoseconds elsewhere.
+uint64_t read_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+// Convert a tick count to nanoseconds, using the tick rate measured since startup
+double ticks_to_ns(struct ipts_state *state, uint64_t ticks) {
+  uint64_t elapsed_ticks = read_ticks() - state->start_ticks;
+  uint64_t elapsed_ns = now_ns() - state->start_ns;
+  if (elapsed_ticks == 0) return ticks;
+  return (double)ticks * elapsed_ns / elapsed_ticks;
+}
+
+// Add the time since start to a stage and return the current time, so calls can be chained
+uint64_t stage_done(struct ipts_state *state, enum stage stage, uint64_t start) {
+  uint64_t now = read_ticks();
+  state->frame_ticks[stage] += now - start;
+  state->frame_stages |= 1 << stage;
+  return now;
+}
+
+// Record the stages that ran in a frame and the frame as a whole
+void frame_done(struct ipts_state *state, uint64_t start) {
+  histogram_add(&state->frame_time, read_ticks() - start);
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    if (!(state->frame_stages & (1 << s))) continue;
+    histogram_add(&state->stages[s], state->frame_ticks[s]);
+    state->frame_ticks[s] = 0;
+  }
+  state->frame_stages = 0;
+  state->frames++;
+}
+
+// Create the touch device, with positions ranging up to max_x and max_y
+int setup_touch_device(int max_x, int max_y) {
   int uinput = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
   ioctl(uinput, UI_SET_EVBIT, EV_KEY);
   ioctl(uinput, UI_SET_KEYBIT, BTN_TOUCH);
@@ -180,6 +1494,8 @@ int main() {
   ioctl(uinput, UI_SET_ABSBIT, ABS_MT_POSITION_Y);
   ioctl(uinput, UI_SET_ABSBIT, ABS_MT_TRACKING_ID);
   ioctl(uinput, UI_SET_ABSBIT, ABS_MT_TOUCH_MAJOR);
+  ioctl(uinput, UI_SET_ABSBIT, ABS_MT_TOUCH_MINOR);
+  ioctl(uinput, UI_SET_ABSBIT, ABS_MT_ORIENTATION);
 
   struct uinput_setup usetup;
   memset(&usetup, 0, sizeof(usetup));
@@ -194,13 +1510,13 @@ int main() {
   abs.absinfo.resolution = 100;
 
   abs.code = ABS_X;
-  abs.absinfo.maximum = WIDTH * SCALE;
+  abs.absinfo.maximum = max_x;
   ioctl(uinput, UI_ABS_SETUP, &abs);
   abs.code = ABS_MT_POSITION_X;
   ioctl(uinput, UI_ABS_SETUP, &abs);
 
   abs.code = ABS_Y;
-  abs.absinfo.maximum = HEIGHT * SCALE;
+  abs.absinfo.maximum = max_y;
   ioctl(uinput, UI_ABS_SETUP, &abs);
   abs.code = ABS_MT_POSITION_Y;
   ioctl(uinput, UI_ABS_SETUP, &abs);
@@ -214,10 +1530,19 @@ int main() {
   abs.code = ABS_MT_TOUCH_MAJOR;
   abs.absinfo.maximum = 1000;
   ioctl(uinput, UI_ABS_SETUP, &abs);
-
+  abs.code = ABS_MT_TOUCH_MINOR;
+  ioctl(uinput, UI_ABS_SETUP, &abs);
+  abs.code = ABS_MT_ORIENTATION;
+  abs.absinfo.minimum = -TOUCH_MAX_ORIENTATION;
+  abs.absinfo.maximum = TOUCH_MAX_ORIENTATION;
+  ioctl(uinput, UI_ABS_SETUP, &abs);
+
   ioctl(uinput, UI_DEV_CREATE);
+  return uinput;
+}
 
-  // Open another uinput device for stylus data
+// Create the uinput device used for stylus data
+int setup_stylus_device() {
   int uinput_stylus = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
   ioctl(uinput_stylus, UI_SET_EVBIT, EV_KEY);
   ioctl(uinput_stylus, UI_SET_EVBIT, EV_ABS);
@@ -234,11 +1559,18 @@ int main() {
   ioctl(uinput_stylus, UI_SET_ABSBIT, ABS_TILT_Y);
   ioctl(uinput_stylus, UI_SET_ABSBIT, ABS_MISC);
 
+  struct uinput_setup usetup;
+  memset(&usetup, 0, sizeof(usetup));
+  usetup.id.bustype = BUS_USB;
   usetup.id.vendor = 0x1234;  /* sample vendor */
   usetup.id.product = 0x5679; /* sample product */
   strcpy(usetup.name, "Test stylus device");
   ioctl(uinput_stylus, UI_DEV_SETUP, &usetup);
 
+  struct uinput_abs_setup abs;
+  memset(&abs, 0, sizeof(abs));
+  abs.absinfo.resolution = 100;
+
   abs.code = ABS_X;
   abs.absinfo.maximum = 9600;
   ioctl(uinput_stylus, UI_ABS_SETUP, &abs);
@@ -263,341 +1595,1549 @@ int main() {
   ioctl(uinput_stylus, UI_ABS_SETUP, &abs);
 
   ioctl(uinput_stylus, UI_DEV_CREATE);
+  return uinput_stylus;
+}
+
+// Find the widest instruction set the CPU supports
+enum isa detect_isa() {
+#ifdef VECTOR_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return ISA_AVX512;
+  if (__builtin_cpu_supports("avx2")) return ISA_AVX2;
+#endif
+  return ISA_DEFAULT;
+}
+
+// Settings from the command line
+struct options {
+  const char *replay_path;
+  int passes;
+  const char *output;
+  int verbose;
+  int pipeline;
+  int cpus[3];
+  enum centroid centroid;
+  enum segment segment;
+  int predict_ms;
+  int stylus_rate;
+  int stylus_phase_us;
+  enum isa isa;
+  const char *record_path;
+  uint64_t slice[2];
+  int realtime;
+  uint64_t fuzz;
+  uint64_t fuzz_seed;
+};
+
+// Allocate memory for the heatmap and clusters
+void init_state(struct ipts_state *state, int uinput, int uinput_stylus, const struct options *options) {
+  memset(state, 0, sizeof(struct ipts_state));
+  state->centroid = options->centroid;
+  state->segment = options->segment;
+  state->isa = options->isa;
+  state->predict = options->predict_ms / 1000.f;
+  if (options->stylus_rate > 0) {
+    state->stylus_resampler.period = 1000000000ull / options->stylus_rate;
+    state->stylus_resampler.phase = options->stylus_phase_us * 1000ull % state->stylus_resampler.period;
+  }
+  if (options->verbose) state->stylus_log = start_stylus_log();
+  state->touch_events.fd = uinput;
+  state->stylus_events.fd = uinput_stylus;
+  // The heatmap has a black row either side, so the rows above and below any pixel can be read
+  state->heatmap = (uint8_t *)calloc(MAX_WIDTH * (MAX_HEIGHT + 2), 1) + MAX_WIDTH;
+  state->cluster_groups = malloc(sizeof(struct cluster_group) * 2);
+  memset(state->cluster_groups, 0, sizeof(struct cluster_group) * 2);
+  state->current_cluster_group = 0;
+  // Fills are at most MAX_CLUSTER_SIZE pixels each, but a watershed can take every pixel of the heatmap
+  state->cluster_pixels = malloc(sizeof(uint16_t) * MAX_WIDTH * MAX_HEIGHT);
+  state->labels = malloc(MAX_WIDTH * MAX_HEIGHT);
+  state->start_ticks = read_ticks();
+  state->start_ns = now_ns();
+}
+
+// Queue the events for one stylus position, ending with a SYN_REPORT
+void emit_stylus(struct event_batch *batch, int x, int y, int pressure, uint16_t mode) {
+  struct input_event *ie = reserve_events(batch, 10);
+  set_event(&ie[0], EV_ABS, ABS_X, x);
+  set_event(&ie[1], EV_ABS, ABS_Y, y);
+  set_event(&ie[2], EV_ABS, ABS_TILT_X, 0);
+  set_event(&ie[3], EV_ABS, ABS_TILT_Y, 0);
+  set_event(&ie[4], EV_ABS, ABS_PRESSURE, pressure);
+  set_event(&ie[5], EV_KEY, BTN_TOUCH, !!(mode & STYLUS_MODE_CONTACT));
+  set_event(&ie[6], EV_KEY, BTN_TOOL_PEN, 0);
+  set_event(&ie[7], EV_KEY, BTN_TOOL_RUBBER, 0);
+  set_event(&ie[8], EV_KEY, BTN_STYLUS, 0);
+  set_event(&ie[9], EV_SYN, SYN_REPORT, 0);
+}
+
+// Queue the position of the pen at a time, between or beyond its last two samples
+void emit_stylus_at(struct event_batch *batch, const struct stylus_sample *a, const struct stylus_sample *b, uint64_t time) {
+  float f = b->time > a->time ? (int64_t)(time - a->time) / (float)(b->time - a->time) : 1;
+  float x = max_float(a->x + (b->x - a->x) * f, 0);
+  float y = max_float(a->y + (b->y - a->y) * f, 0);
+  float pressure = max_float(a->pressure + (b->pressure - a->pressure) * f, 0);
+  // Clamped to be non-negative, so adding a half and truncating rounds to nearest
+  emit_stylus(batch, (int)(x + 0.5f), (int)(y + 0.5f), (int)(pressure + 0.5f), b->mode);
+}
+
+// First point of the output grid after a time
+uint64_t stylus_grid_after(const struct stylus_resampler *resampler, uint64_t time) {
+  if (time < resampler->phase) return resampler->phase;
+  return ((time - resampler->phase) / resampler->period + 1) * resampler->period + resampler->phase;
+}
+
+// Queue the positions of the pen at each grid point up to a new element
+// Points between the last sample and the element are interpolated. The pen appearing and contact changing
+// are written as received, so a tap shorter than the output period is not lost.
+void resample_stylus(struct ipts_state *state, struct ipts_stylus_element *element) {
+  struct stylus_resampler *resampler = &state->stylus_resampler;
+  struct event_batch *uinput_stylus = &state->stylus_events;
+
+  struct stylus_sample sample = {0, element->x, element->y, element->pressure, element->mode};
+  sample.time = resampler->ticks * STYLUS_TICK_NS + resampler->offset;
+
+  if (!resampler->tracking || ((sample.mode ^ resampler->last.mode) & STYLUS_MODE_CONTACT)) {
+    emit_stylus(uinput_stylus, sample.x, sample.y, sample.pressure, sample.mode);
+    if (sample.time > resampler->output) resampler->output = sample.time;
+    if (!resampler->tracking) resampler->last = sample;
+  } else {
+    int count = 0;
+    for (uint64_t g = stylus_grid_after(resampler, resampler->output); g <= sample.time && count < STYLUS_MAX_RESAMPLES; g = stylus_grid_after(resampler, g)) {
+      emit_stylus_at(uinput_stylus, &resampler->last, &sample, g);
+      resampler->output = g;
+      count++;
+    }
+  }
+  resampler->tracking = 1;
+  resampler->previous = resampler->last;
+  resampler->last = sample;
+}
+
+// Queue the events for a stylus report
+// Each element in proximity becomes a fixed block of events written straight into the batch, and the whole
+// report is sent with one write. Elements are only copied to the log, never printed here. When resampling,
+// the report is followed by where the pen is expected to be at the next grid point.
+void process_stylus(struct ipts_state *state, void *report) {
+  struct ipts_stylus_report *ipts_stylus_report = report;
+  struct event_batch *uinput_stylus = &state->stylus_events;
+  struct stylus_resampler *resampler = &state->stylus_resampler;
+  uint64_t now = resampler->period ? (state->frame_ns ? state->frame_ns : now_ns()) : 0;
+
+  // Loop through stylus elements
+  for (int n = 0; n < ipts_stylus_report->elements; n++) {
+    struct ipts_stylus_element *ipts_stylus_element = report + 8 + n * 16;
+    if (state->stylus_log) {
+      struct stylus_log_entry *entry = ring_reserve(&state->stylus_log->ring);
+      if (entry) {
+        entry->first = n == 0;
+        entry->serial = ipts_stylus_report->serial;
+        entry->element = *ipts_stylus_element;
+        ring_commit(&state->stylus_log->ring);
+      } else {
+        state->stylus_log->dropped++;
+      }
+    }
+
+    if (resampler->period) {
+      // Unwrap the timestamp, and move the offset to the earliest arrival seen, letting it creep later to
+      // follow drift between the clocks
+      resampler->ticks += (uint16_t)(ipts_stylus_element->timestamp - (uint16_t)resampler->ticks);
+      int64_t offset = now - resampler->ticks * STYLUS_TICK_NS;
+      if (offset < resampler->offset + STYLUS_DRIFT_NS || offset > resampler->offset + STYLUS_REANCHOR_MS * 1000000ll) {
+        resampler->offset = offset;
+      } else {
+        resampler->offset += STYLUS_DRIFT_NS;
+      }
+    }
+
+    if (!(ipts_stylus_element->mode & STYLUS_MODE_PROXIMITY)) {
+      resampler->tracking = 0;
+      continue;
+    }
+
+    if (resampler->period) {
+      resample_stylus(state, ipts_stylus_element);
+    } else {
+      emit_stylus(uinput_stylus, ipts_stylus_element->x, ipts_stylus_element->y, ipts_stylus_element->pressure, ipts_stylus_element->mode);
+    }
+  }
+
+  // Extrapolate from the last two samples to the next grid point, unless that is too far ahead
+  if (resampler->period && resampler->tracking) {
+    uint64_t g = stylus_grid_after(resampler, now > resampler->output ? now : resampler->output);
+    if (g - resampler->last.time <= STYLUS_MAX_PREDICT_MS * 1000000ull) {
+      emit_stylus_at(uinput_stylus, &resampler->previous, &resampler->last, g);
+      resampler->output = g;
+    }
+  }
+
+  // Send all elements of the report at once
+  flush_events(uinput_stylus);
+}
+
+// Vector kernels of one geometry, built for one instruction set
+struct kernels {
+  void (*transform_heatmap)(const uint8_t *raw, uint8_t *heatmap);
+  void (*find_peaks)(const uint8_t *heatmap, uint64_t *peaks);
+  void (*cluster_moments)(const uint8_t *heatmap, const uint16_t *pixels, int count, struct moments *moments);
+};
+
+// Instantiate the kernels of one geometry for one instruction set
+// find_peaks keeps its column maxima with a black pixel either side, so neighbours can be read at offsets -1,
+// 0 and 1.
+#define DEFINE_KERNELS(isa, w, h)                                                                                                           \
+  TARGET_##isa void transform_heatmap_##w##x##h##_##isa(const uint8_t *raw, uint8_t *heatmap) {                                             \
+    transform_heatmap_##isa(raw, heatmap, w, h, 0);                                                                                         \
+  }                                                                                                                                         \
+  TARGET_##isa void find_peaks_##w##x##h##_##isa(const uint8_t *heatmap, uint64_t *peaks) {                                                 \
+    uint8_t column_max[w * h + 2];                                                                                                          \
+    column_max[0] = 0;                                                                                                                      \
+    column_max[w * h + 1] = 0;                                                                                                              \
+    memset(peaks, 0, sizeof(uint64_t) * ((w * h + 63) / 64));                                                                               \
+    column_max_##isa(heatmap, column_max + 1, w, h, 0);                                                                                     \
+    peak_mask_##isa(heatmap, column_max + 1, peaks, w, h, 0);                                                                               \
+    peak_mask_edges(heatmap, column_max + 1, peaks, w, h);                                                                                  \
+  }                                                                                                                                         \
+  TARGET_##isa void cluster_moments_##w##x##h##_##isa(const uint8_t *heatmap, const uint16_t *pixels, int count, struct moments *moments) { \
+    cluster_moments_##isa(heatmap, pixels, count, moments, w, 0);                                                                           \
+  }
+#define KERNELS_ENTRY(isa, w, h) {transform_heatmap_##w##x##h##_##isa, find_peaks_##w##x##h##_##isa, cluster_moments_##w##x##h##_##isa},
+
+// Find the clusters in a raw heatmap of one geometry
+// The heatmap is transformed, its peaks found and grown into clusters, and the bounds of each cluster worked
+// out. Timings of each stage are recorded from t, and the time the last stage finished is returned.
+GEOMETRY_INLINE uint64_t find_clusters(struct ipts_state *state, const uint8_t *raw, struct cluster_group *cluster_group, uint64_t t, const struct kernels *kernels, int width, int height) {
+  uint8_t *heatmap = state->heatmap;
+  int disable_touch = 0;
+
+  // Copy pixels from raw frame and invert both axes as well as the values
+  kernels->transform_heatmap(raw, heatmap);
+
+  t = stage_done(state, STAGE_TRANSFORM, t);
+
+  // First identify the brightest pixels in the heatmap
+  // These are pixels that have no brighter neighbor
+  uint64_t peaks[(MAX_WIDTH * MAX_HEIGHT + 63) / 64];
+  kernels->find_peaks(heatmap, peaks);
+  t = stage_done(state, STAGE_PEAKS, t);
+
+  // Group pixels into clusters
+  struct component components[MAX_CLUSTERS];
+  if (state->segment == SEGMENT_COMPONENTS) {
+    cluster_group->size = connected_components(heatmap, state->labels, cluster_group, state->cluster_pixels, components, width, height);
+  } else if (state->segment == SEGMENT_WATERSHED) {
+    cluster_group->size = watershed(heatmap, peaks, state->labels, cluster_group, state->cluster_pixels, width, height);
+  } else {
+    cluster_group->size = 0;
+    int arena_size = 0;
+    for (int w = 0; w < (width * height + 63) / 64; w++) {
+      for (uint64_t mask = peaks[w]; mask; mask &= mask - 1) {
+        int i = w * 64 + __builtin_ctzll(mask);
+        // For each bright spot, create a cluster and add surrounding pixels to it
+        if (cluster_group->size < MAX_CLUSTERS) {
+          int n = cluster_group->size++;
+          cluster_group->offset[n] = arena_size;
+          cluster_group->count[n] = assign_group_dimmer(heatmap, i % width, i / width, &state->cluster_pixels[arena_size], width, height);
+          arena_size += cluster_group->count[n];
+        }
+      }
+    }
+  }
+
+  t = stage_done(state, STAGE_CLUSTERS, t);
+
+  // Calculate bounds of each cluster
+  // We use floats to do this in the device space. We can convert to screen space later
+  for (int i = 0; i < cluster_group->size; i++) {
+    // Use each pixel's position and value to create a weighted average position
+    const uint16_t *pixels = &state->cluster_pixels[cluster_group->offset[i]];
+    // Components were added up while they were labelled
+    struct moments moments = {0, 0, 0, 0, 0, 0};
+    if (state->segment == SEGMENT_COMPONENTS) {
+      moments = components[i].moments;
+    } else {
+      kernels->cluster_moments(heatmap, pixels, cluster_group->count[i], &moments);
+    }
+    if (state->centroid == CENTROID_PEAK) {
+      // Or fit the shape of the brightest pixel, the first one added to the cluster
+      int centre_x;
+      int centre_y;
+      subpixel_peak(heatmap, pixels[0] % width, pixels[0] / width, &centre_x, &centre_y, width, height);
+      cluster_group->centre_x[i] = centre_x / (float)(1 << SUBPIXEL_BITS);
+      cluster_group->centre_y[i] = centre_y / (float)(1 << SUBPIXEL_BITS);
+    } else {
+      cluster_group->centre_x[i] = (float)moments.sum_x / moments.sum + 0.5f;
+      cluster_group->centre_y[i] = (float)moments.sum_y / moments.sum + 0.5f;
+    }
+    cluster_group->diameter[i] = moments.sum / 100.f;
+    fit_ellipse(&moments, &cluster_group->major[i], &cluster_group->minor[i], &cluster_group->orientation[i]);
+    // Use the centre of the cluster and total weight to approximate a bounding box
+    cluster_group->x1[i] = cluster_group->centre_x[i] - cluster_group->diameter[i] / 2;
+    cluster_group->y1[i] = cluster_group->centre_y[i] - cluster_group->diameter[i] / 2;
+    cluster_group->x2[i] = cluster_group->centre_x[i] + cluster_group->diameter[i] / 2;
+    cluster_group->y2[i] = cluster_group->centre_y[i] + cluster_group->diameter[i] / 2;
+    // Mark all clusters as valid intially, and without an ID until tracking gives them one
+    // We could add additional checks here to filter out clusters that are too small or too large
+    cluster_group->valid[i] = cluster_group->diameter[i] > 0.5f;
+    cluster_group->id[i] = 0;
+    if (cluster_group->diameter[i] > 10.f) disable_touch = 1;
+  }
+
+  if (disable_touch) {
+    // If we have a cluster that is too large, disable touch
+    for (int i = 0; i < cluster_group->size; i++) {
+      cluster_group->valid[i] = 0;
+    }
+  }
+
+  return stage_done(state, STAGE_BOUNDS, t);
+}
+
+// A copy of the heatmap pipeline for each geometry, and a table to choose between them
+#define DEFINE_FIND_CLUSTERS(w, h)                                                                                                  \
+  ISAS(DEFINE_KERNELS, w, h)                                                                                                        \
+  const struct kernels kernels_##w##x##h[ISA_COUNT] = {ISAS(KERNELS_ENTRY, w, h)};                                                  \
+  uint64_t find_clusters_##w##x##h(struct ipts_state *state, const uint8_t *raw, struct cluster_group *cluster_group, uint64_t t) { \
+    return find_clusters(state, raw, cluster_group, t, &kernels_##w##x##h[state->isa], w, h);                                       \
+  }
+GEOMETRIES(DEFINE_FIND_CLUSTERS)
+
+struct geometry {
+  int width;
+  int height;
+  uint64_t (*find_clusters)(struct ipts_state *state, const uint8_t *raw, struct cluster_group *cluster_group, uint64_t t);
+};
+
+#define GEOMETRY_ENTRY(w, h) {w, h, find_clusters_##w##x##h},
+const struct geometry geometries[] = {GEOMETRIES(GEOMETRY_ENTRY)};
+
+// Find the geometry of a heatmap report from its size, or NULL if it is not one we know
+const struct geometry *find_geometry(struct ipts_state *state, int size) {
+  if (state->geometry && state->geometry->width * state->geometry->height == size) return state->geometry;
+  for (int i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++) {
+    if (geometries[i].width * geometries[i].height == size) {
+      state->geometry = &geometries[i];
+      return state->geometry;
+    }
+  }
+  return NULL;
+}
+
+// Walk the headers of a frame of length bytes and fill in a view of its reports
+// Every size field is checked against what is left of the frame, and stylus reports against their element
+// count, so the report handlers can trust the view. A frame with any inconsistent header is dropped whole
+// and -1 returned, frames that are not touch data give an empty view.
+int parse_frame(void *buf, size_t length, struct frame_view *view) {
+  uint8_t *frame = buf;
+  size_t pos = sizeof(struct ipts_hid_header) + sizeof(struct ipts_raw_header);
+  int count = 0;
+  view->count = 0;
+  if (length < pos) return -1;
+  if (((struct ipts_hid_header *)frame)->type != 0xEE) return 0;
+
+  struct ipts_raw_header *ipts_raw_header = (void *)(frame + sizeof(struct ipts_hid_header));
+  for (uint32_t n = 0; n < ipts_raw_header->frames; n++) {
+    if (length - pos < sizeof(struct ipts_raw_frame_header)) return -1;
+    struct ipts_raw_frame_header *ipts_raw_frame_header = (void *)(frame + pos);
+    pos += sizeof(struct ipts_raw_frame_header);
+    if (ipts_raw_frame_header->size > length - pos) return -1;
+    size_t eof = pos + ipts_raw_frame_header->size;
+
+    if (ipts_raw_frame_header->type == 6 || ipts_raw_frame_header->type == 8) {
+      while (pos < eof) {
+        if (eof - pos < sizeof(struct ipts_report_header)) return -1;
+        struct ipts_report_header *ipts_report_header = (void *)(frame + pos);
+        pos += sizeof(struct ipts_report_header);
+        if (ipts_report_header->size > eof - pos) return -1;
+        if (ipts_report_header->type == 0x60) {
+          if (ipts_report_header->size < sizeof(struct ipts_stylus_report)) return -1;
+          struct ipts_stylus_report *ipts_stylus_report = (void *)(frame + pos);
+          if (sizeof(struct ipts_stylus_report) + ipts_stylus_report->elements * sizeof(struct ipts_stylus_element) > ipts_report_header->size) return -1;
+        }
+        if (ipts_report_header->type == 0x60 || ipts_report_header->type == 0x25) {
+          if (count == MAX_REPORTS) return -1;
+          view->reports[count++] = (struct report_view){ipts_report_header->type, ipts_report_header->size, frame + pos};
+        }
+        pos += ipts_report_header->size;
+      }
+    }
+    pos = eof;
+  }
+  view->count = count;
+  return 0;
+}
+
+// Find the geometry of the heatmaps a device sends, so the touch device can be given the same aspect ratio
+// Frames are read for up to PROBE_MS until one holds a heatmap of a known size. The first geometry is assumed
+// if none arrives in time. The frames read are dropped, nothing is listening for touches yet.
+const struct geometry *probe_geometry(int fd) {
+  uint8_t buf[FRAME_SIZE];
+  uint64_t deadline = now_ns() + PROBE_MS * 1000000ull;
+  for (uint64_t now = now_ns(); now < deadline; now = now_ns()) {
+    struct pollfd ready = {.fd = fd, .events = POLLIN};
+    if (poll(&ready, 1, (deadline - now) / 1000000 + 1) <= 0) continue;
+    int n = read(fd, buf, FRAME_SIZE);
+    if (n <= 0) continue;
+    struct frame_view view;
+    if (parse_frame(buf, n, &view) < 0) continue;
+    for (int r = 0; r < view.count; r++) {
+      if (view.reports[r].type != 0x25) continue;
+      for (int i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++) {
+        if (geometries[i].width * geometries[i].height == view.reports[r].size) return &geometries[i];
+      }
+    }
+  }
+  fprintf(stderr, "No heatmap within %d ms, assuming a %dx%d sensor\n", PROBE_MS, geometries[0].width, geometries[0].height);
+  return &geometries[0];
+}
+
+// Parse and process one frame of length bytes read from the device
+void process_frame(struct ipts_state *state, void *buf, int length) {
+  uint64_t start = read_ticks();
+  uint64_t t = start;
+  struct event_batch *uinput = &state->touch_events;
+
+  // Sizes are checked once here, so the reports can be used without any further checks
+  struct frame_view view;
+  if (parse_frame(buf, length, &view) < 0) state->malformed_frames++;
+  for (int r = 0; r < view.count; r++) {
+    const struct report_view *report = &view.reports[r];
+    const struct geometry *geometry;
+    if (report->type == 0x60) {
+      t = stage_done(state, STAGE_PARSE, t);
+      process_stylus(state, report->data);
+      t = stage_done(state, STAGE_STYLUS, t);
+    } else if (report->type == 0x25 && (geometry = find_geometry(state, report->size))) {
+      // We have heatmap data, start processing!
+      t = stage_done(state, STAGE_PARSE, t);
+      uint64_t heatmap_ns = state->frame_ns ? state->frame_ns : now_ns();
+      uint64_t heatmap_interval = heatmap_ns - state->last_heatmap_ns;
+      state->last_heatmap_ns = heatmap_ns;
+      uint8_t *raw_pixels = report->data;
+
+      // Swap cluster groups, the previous heatmap's clusters are kept for tracking
+      // The group is not cleared, every slot below its size is written before it is read
+      struct cluster_group *cluster_group = &state->cluster_groups[state->current_cluster_group];
+      struct cluster_group *previous_cluster_group = &state->cluster_groups[state->current_cluster_group ^ 1];
+      state->current_cluster_group ^= 1;
+
+      // Find the clusters with the pipeline built for this geometry
+      t = geometry->find_clusters(state, raw_pixels, cluster_group, t);
+
+      // Remove overlapping clusters, fills can claim the same pixels but the other segmenters never do
+      if (state->segment == SEGMENT_FILL) {
+        remove_overlaps(cluster_group);
+        t = stage_done(state, STAGE_OVERLAP, t);
+      }
+
+      // Attempt to collelate clusters with those from previous frames
+      // Previous and current clusters are paired so that the total squared distance between them is as small as
+      // possible. Distances are capped at TRACKING_GATE, so a pair further apart than that costs the same as
+      // leaving both unpaired, and is not used to carry an ID over.
+      int previous_index[MAX_CLUSTERS];
+      int current_index[MAX_CLUSTERS];
+      int previous_count = 0;
+      int current_count = 0;
+      for (int n = 0; n < previous_cluster_group->size; n++) {
+        if (previous_cluster_group->valid[n]) previous_index[previous_count++] = n;
+      }
+      for (int m = 0; m < cluster_group->size; m++) {
+        if (cluster_group->valid[m]) current_index[current_count++] = m;
+      }
+      if (previous_count > 0 && current_count > 0) {
+        const float gate = TRACKING_GATE * TRACKING_GATE;
+        // Pad to a square matrix, rows and columns past the real clusters stand for "unpaired"
+        // The padding is placed far off the heatmap, so it costs the gate to pair with any real cluster and
+        // every distance is worked out the same way, without branches. Only one side is ever padded.
+        int size = previous_count > current_count ? previous_count : current_count;
+        float previous_x[MAX_CLUSTERS];
+        float previous_y[MAX_CLUSTERS];
+        float current_x[MAX_CLUSTERS];
+        float current_y[MAX_CLUSTERS];
+        for (int i = 0; i < size; i++) {
+          previous_x[i] = i < previous_count ? previous_cluster_group->centre_x[previous_index[i]] : -TRACKING_FAR;
+          previous_y[i] = i < previous_count ? previous_cluster_group->centre_y[previous_index[i]] : -TRACKING_FAR;
+          current_x[i] = i < current_count ? cluster_group->centre_x[current_index[i]] : -TRACKING_FAR;
+          current_y[i] = i < current_count ? cluster_group->centre_y[current_index[i]] : -TRACKING_FAR;
+        }
+        float cost[MAX_CLUSTERS * MAX_CLUSTERS];
+        for (int i = 0; i < size; i++) {
+          for (int j = 0; j < size; j++) {
+            float dx = current_x[j] - previous_x[i];
+            float dy = current_y[j] - previous_y[i];
+            cost[i * size + j] = min_float(dx * dx + dy * dy, gate);
+          }
+        }
+        int assignment[MAX_CLUSTERS];
+        solve_assignment(cost, size, assignment);
+        for (int i = 0; i < previous_count; i++) {
+          int j = assignment[i];
+          if (j < current_count && cost[i * size + j] < gate) {
+            cluster_group->id[current_index[j]] = previous_cluster_group->id[previous_index[i]];
+          }
+        }
+      }
+
+      // Assign new IDs to any clusters that don't have one yet
+      for (int m = 0; m < cluster_group->size; m++) {
+        if (cluster_group->valid[m] && cluster_group->id[m] == 0) {
+          // Find the lowest unused ID
+          int id = 1;
+          while (1) {
+            int found = 0;
+            for (int n = 0; n < cluster_group->size; n++) {
+              if (cluster_group->id[n] == id) {
+                found = 1;
+                break;
+              }
+            }
+            if (!found) break;
+            id++;
+          }
+          cluster_group->id[m] = id;
+          state->touch_filters[id].active = 0;
+        }
+      }
+
+      // Work out where each touch will be by the time it is seen, or use the measured position
+      // A new touch starts its filter, any other advances its filter by the time since the last heatmap.
+      float touch_x[MAX_CLUSTERS];
+      float touch_y[MAX_CLUSTERS];
+      float interval = heatmap_interval / 1e9f;
+      if (state->nominal_period || interval < 0.001f || interval > STALE_TOUCH_MS / 1000.f) interval = HEATMAP_PERIOD_MS / 1000.f;
+      for (int i = 0; i < cluster_group->size; i++) {
+        touch_x[i] = cluster_group->centre_x[i];
+        touch_y[i] = cluster_group->centre_y[i];
+        if (state->predict == 0 || !cluster_group->valid[i]) continue;
+        struct touch_filter *filter = &state->touch_filters[cluster_group->id[i]];
+        if (filter->active) {
+          touch_filter_update(filter, touch_x[i], touch_y[i], interval);
+        } else {
+          touch_filter_reset(filter, touch_x[i], touch_y[i]);
+        }
+        touch_x[i] = min_float(max_float(filter->x + filter->vx * state->predict, 0), geometry->width);
+        touch_y[i] = min_float(max_float(filter->y + filter->vy * state->predict, 0), geometry->height);
+      }
+
+      t = stage_done(state, STAGE_TRACKING, t);
+
+      // Draw raw data to screen
+      // for (int y = 0; y < HEIGHT; y++) {
+      //   for (int x = 0; x < WIDTH; x++) {
+      //     int xx = WIDTH - x - 1;
+      //     int yy = HEIGHT - y - 1;
+      //     uint8_t pixel = 255 - raw_pixels[yy * WIDTH + xx];
+      //     SDL_Rect rect;
+      //     rect.x = x * SCALE;
+      //     rect.y = y * SCALE;
+      //     rect.w = SCALE;
+      //     rect.h = SCALE;
+      //     SDL_SetRenderDrawColor(ren, pixel, pixel, pixel, 255);
+      //     SDL_RenderFillRect(ren, &rect);
+      //   }
+      // }
+
+      // Draw clusters to screen
+      // int valid_clusters = 0;
+      // for (int i = 0; i < cluster_group->size; i++) {
+      //   SDL_Rect rect;
+      //   rect.x = cluster_group->x1[i] * SCALE;
+      //   rect.y = cluster_group->y1[i] * SCALE;
+      //   rect.w = cluster_group->diameter[i] * SCALE;
+      //   rect.h = cluster_group->diameter[i] * SCALE;
+      //   if (cluster_group->valid[i]) {
+      //     SDL_SetRenderDrawColor(ren, 0, 255, 0, 255);
+      //     valid_clusters++;
+      //     char text[100];
+      //     sprintf(text, "%d", cluster_group->id[i]);
+      //     SDL_Surface *surface;
+      //     SDL_Color color = {0, 0, 0};
+      //     surface = TTF_RenderText_Solid(font, text, color);
+      //     SDL_Texture *texture = SDL_CreateTextureFromSurface(ren, surface);
+      //     SDL_Rect dstrect = {rect.x, rect.y, surface->w, surface->h};
+      //     SDL_FreeSurface(surface);
+      //     SDL_RenderCopy(ren, texture, NULL, &dstrect);
+      //     SDL_DestroyTexture(texture);
+      //   } else {
+      //     SDL_SetRenderDrawColor(ren, 255, 0, 0, 255);
+      //   }
+      //   SDL_RenderDrawRect(ren, &rect);
+      // }
+
+      // Draw cluster count to screen
+      // char text[100];
+      // sprintf(text, "Clusters: %d", valid_clusters);
+      // SDL_Surface *surface;
+      // SDL_Color color = {0, 0, 0};
+      // surface = TTF_RenderText_Solid(font, text, color);
+      // SDL_Texture *texture = SDL_CreateTextureFromSurface(ren, surface);
+      // SDL_Rect dstrect = {0, 0, surface->w, surface->h};
+      // SDL_FreeSurface(surface);
+      // SDL_RenderCopy(ren, texture, NULL, &dstrect);
+      // SDL_DestroyTexture(texture);
+
+      // Update screen
+      // SDL_RenderPresent(ren);
+
+      int valid_clusters = 0;
+      for (int n = 0; n < cluster_group->size; n++) {
+        if (cluster_group->valid[n]) {
+          valid_clusters++;
+        }
+      }
+
+      // Emit to uinput, scaling positions from heatmap pixels to the device's range
+      float scale_x = state->touch_max_x ? (float)state->touch_max_x / geometry->width : SCALE;
+      float scale_y = state->touch_max_y ? (float)state->touch_max_y / geometry->height : SCALE;
+      // The ellipse axes lie in any direction, so they take the mean, which is the same factor while the ranges keep
+      // the heatmap's aspect
+      float scale_axis = (scale_x + scale_y) / 2;
+      for (int n = 0; n < TOUCH_SLOTS; n++) {
+        emit(uinput, EV_ABS, ABS_MT_SLOT, n);
+        int tracking_id = -1;
+        for (int i = 0; i < cluster_group->size; i++) {
+          if (cluster_group->id[i] == n + 1 && cluster_group->valid[i]) {
+            emit(uinput, EV_ABS, ABS_MT_POSITION_X, touch_x[i] * scale_x);
+            emit(uinput, EV_ABS, ABS_MT_POSITION_Y, touch_y[i] * scale_y);
+            emit(uinput, EV_ABS, ABS_MT_TOUCH_MAJOR, cluster_group->major[i] * scale_axis);
+            emit(uinput, EV_ABS, ABS_MT_TOUCH_MINOR, cluster_group->minor[i] * scale_axis);
+            emit(uinput, EV_ABS, ABS_MT_ORIENTATION, cluster_group->orientation[i]);
+            tracking_id = cluster_group->id[i];
+            if (valid_clusters == 1) {
+              emit(uinput, EV_ABS, ABS_X, touch_x[i] * scale_x);
+              emit(uinput, EV_ABS, ABS_Y, touch_y[i] * scale_y);
+              emit(uinput, EV_KEY, BTN_TOUCH, 1);
+            }
+          }
+        }
+        emit(uinput, EV_ABS, ABS_MT_TRACKING_ID, tracking_id);
+      }
+      if (valid_clusters != 1) {
+        emit(uinput, EV_KEY, BTN_TOUCH, 0);
+      }
+
+      emit(uinput, EV_SYN, SYN_REPORT, 0);
+      flush_events(uinput);
+      state->touching = valid_clusters > 0;
+
+      t = stage_done(state, STAGE_EMIT, t);
+
+      // Sleep 100ms
+      // nanosleep((const struct timespec[]){{0, 50000000L}}, NULL);
+    }
+  }
+  stage_done(state, STAGE_PARSE, t);
+  frame_done(state, start);
+}
+
+// Lift all touches, used when heatmaps stop arriving while a finger is down
+void release_touches(struct ipts_state *state) {
+  for (int n = 0; n < TOUCH_SLOTS; n++) {
+    emit(&state->touch_events, EV_ABS, ABS_MT_SLOT, n);
+    emit(&state->touch_events, EV_ABS, ABS_MT_TRACKING_ID, -1);
+  }
+  emit(&state->touch_events, EV_KEY, BTN_TOUCH, 0);
+  emit(&state->touch_events, EV_SYN, SYN_REPORT, 0);
+  flush_events(&state->touch_events);
+  state->touching = 0;
+  // Touches that come back are new ones, so don't carry their IDs over
+  state->cluster_groups[0].size = 0;
+  state->cluster_groups[1].size = 0;
+}
+
+// Periodic work that does not depend on frames arriving
+void housekeeping(struct ipts_state *state) {
+  // Lift fingers if the heatmaps have stopped, so they are not left stuck down
+  if (state->touching && now_ns() - state->last_heatmap_ns > STALE_TOUCH_MS * 1000000ull) release_touches(state);
+}
+
+// Print the time spent in each stage, averaged over all frames and as percentiles of the frames it ran in
+void print_stats(struct ipts_state *state) {
+  uint64_t frames = state->frames ? state->frames : 1;
+  fprintf(stderr, "heatmap kernels: %s\n", isa_names[state->isa]);
+  fprintf(stderr, "%-10s %10s %10s %10s %10s %10s\n", "stage", "ns/frame", "runs", "p50 ns", "p99 ns", "max ns");
+  for (int s = 0; s <= STAGE_COUNT; s++) {
+    struct histogram *histogram = s < STAGE_COUNT ? &state->stages[s] : &state->frame_time;
+    fprintf(stderr, "%-10s %10.1f %10lu %10.0f %10.0f %10.0f\n", s < STAGE_COUNT ? stage_names[s] : "total", ticks_to_ns(state, histogram->total) / frames,
+            histogram->count, ticks_to_ns(state, histogram_percentile(histogram, 0.5)), ticks_to_ns(state, histogram_percentile(histogram, 0.99)),
+            ticks_to_ns(state, histogram->max));
+  }
+  if (state->touch_events.dropped || state->stylus_events.dropped) {
+    fprintf(stderr, "dropped frames: touch %lu, stylus %lu\n", state->touch_events.dropped, state->stylus_events.dropped);
+  }
+  if (state->malformed_frames) fprintf(stderr, "malformed frames: %lu\n", state->malformed_frames);
+  if (state->stylus_log && state->stylus_log->dropped) fprintf(stderr, "dropped stylus log entries: %lu\n", state->stylus_log->dropped);
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+uint64_t percentile(uint64_t *sorted, size_t count, double p) {
+  size_t rank = (size_t)ceil(p * count);
+  if (rank < 1) rank = 1;
+  return sorted[rank - 1];
+}
+
+// Indexed capture files
+// A capture starts with a header, followed by one record per frame and then an index holding the file offset of
+// every record, which the header points to once the capture is closed. Each record has the monotonic time the
+// frame was read. Most records hold the frame as runs of bytes that differ from the frame before, which
+// shrinks unchanged heatmaps to almost nothing, while every keyframe_interval'th frame is stored whole so any
+// frame can be decoded by starting from the keyframe before it.
+#define CAPTURE_MAGIC "IPTSCAP1"
+#define CAPTURE_KEYFRAME_INTERVAL 64
+
+struct capture_header {
+  char magic[8];
+  uint32_t frame_size;
+  uint32_t keyframe_interval;
+  uint64_t frames;
+  uint64_t index_offset;
+} __attribute__((packed));
+
+struct capture_record {
+  uint64_t time;
+  uint32_t size;
+  uint8_t delta;
+} __attribute__((packed));
+
+// Runs in a delta record, skip bytes are unchanged and the following length bytes are replaced
+struct capture_run {
+  uint16_t skip;
+  uint16_t length;
+} __attribute__((packed));
+
+struct capture_writer {
+  FILE *file;
+  uint64_t frames;
+  uint64_t *index;
+  uint64_t index_size;
+  uint64_t offset;
+  uint8_t previous[FRAME_SIZE];
+  uint8_t delta[FRAME_SIZE];
+};
+
+// Encode a frame as the runs that differ from the previous one
+// Returns the size of the encoding, 0 for an unchanged frame, or -1 if it would be no smaller than the frame itself.
+int encode_delta(const uint8_t *previous, const uint8_t *frame, uint8_t *out) {
+  int size = 0;
+  int i = 0;
+  while (i < FRAME_SIZE) {
+    int start = i;
+    while (i < FRAME_SIZE && i - start < UINT16_MAX && frame[i] == previous[i]) i++;
+    int skip = i - start;
+    if (i == FRAME_SIZE) break;
+    // A changed run ends at a few unchanged bytes in a row, fewer would cost more to skip than to copy
+    start = i;
+    int same = 0;
+    while (i < FRAME_SIZE && i - start < UINT16_MAX && same < sizeof(struct capture_run)) {
+      same = frame[i] == previous[i] ? same + 1 : 0;
+      i++;
+    }
+    i -= same;
+    int length = i - start;
+    if (size + sizeof(struct capture_run) + length >= FRAME_SIZE) return -1;
+    struct capture_run run = {skip, length};
+    memcpy(out + size, &run, sizeof(run));
+    memcpy(out + size + sizeof(run), frame + start, length);
+    size += sizeof(run) + length;
+  }
+  return size;
+}
+
+// Apply a delta encoding to the previous frame, returns -1 if it does not fit
+int decode_delta(uint8_t *frame, const uint8_t *delta, int size) {
+  int i = 0;
+  int pos = 0;
+  while (pos + (int)sizeof(struct capture_run) <= size) {
+    struct capture_run run;
+    memcpy(&run, delta + pos, sizeof(run));
+    pos += sizeof(run);
+    i += run.skip;
+    if (i + run.length > FRAME_SIZE || pos + run.length > size) return -1;
+    memcpy(frame + i, delta + pos, run.length);
+    i += run.length;
+    pos += run.length;
+  }
+  return pos == size ? 0 : -1;
+}
+
+struct capture_writer *capture_create(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) return NULL;
+  struct capture_writer *writer = calloc(1, sizeof(struct capture_writer));
+  writer->file = file;
+  struct capture_header header = {CAPTURE_MAGIC, FRAME_SIZE, CAPTURE_KEYFRAME_INTERVAL, 0, 0};
+  fwrite(&header, sizeof(header), 1, file);
+  writer->offset = sizeof(header);
+  return writer;
+}
+
+// Append a frame read at a time to a capture
+// Writes go through stdio's buffer, so a frame costs a copy and an occasional write rather than a syscall.
+void capture_write(struct capture_writer *writer, uint64_t time, const uint8_t *frame) {
+  if (writer->frames == writer->index_size) {
+    writer->index_size = writer->index_size ? writer->index_size * 2 : 4096;
+    writer->index = realloc(writer->index, sizeof(uint64_t) * writer->index_size);
+  }
+  writer->index[writer->frames] = writer->offset;
+
+  struct capture_record record = {time, FRAME_SIZE, 0};
+  if (writer->frames % CAPTURE_KEYFRAME_INTERVAL != 0) {
+    int size = encode_delta(writer->previous, frame, writer->delta);
+    if (size >= 0) record = (struct capture_record){time, size, 1};
+  }
+  fwrite(&record, sizeof(record), 1, writer->file);
+  if (record.size) fwrite(record.delta ? writer->delta : frame, record.size, 1, writer->file);
+  memcpy(writer->previous, frame, FRAME_SIZE);
+  writer->offset += sizeof(record) + record.size;
+  writer->frames++;
+}
+
+// Write the index and point the header at it
+void capture_close(struct capture_writer *writer) {
+  fwrite(writer->index, sizeof(uint64_t), writer->frames, writer->file);
+  struct capture_header header = {CAPTURE_MAGIC, FRAME_SIZE, CAPTURE_KEYFRAME_INTERVAL, writer->frames, writer->offset};
+  fseek(writer->file, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, writer->file);
+  fclose(writer->file);
+  free(writer->index);
+  free(writer);
+}
 
-  // Open a hidraw device(or test file)
-  int fd = open("/dev/hidraw0", O_RDWR);
+// A capture being replayed, either raw frames back to back or an indexed capture
+// The file is mapped, so frames stored whole are handed to the parser where they lie. Only delta records are
+// decoded, into frame, starting from a copy of the frame before if that was still in the mapping.
+struct capture_reader {
+  const uint8_t *data;
+  size_t size;
+  int indexed;
+  uint64_t frames;
+  uint32_t keyframe_interval;
+  uint64_t *index;
+  // The next frame to decode, and the last one decoded with the time it was read, counted in nominal frame
+  // periods for raw captures
+  uint64_t next;
+  const uint8_t *current;
+  uint64_t time;
+  uint8_t frame[FRAME_SIZE];
+};
+
+int capture_open(struct capture_reader *reader, const char *path) {
+  memset(reader, 0, sizeof(struct capture_reader));
+  int fd = open(path, O_RDONLY);
   if (fd < 0) {
-    fd = open("/dev/hidraw1", O_RDWR);
-    if (fd < 0) {
-      perror("Error opening device/file");
-      return 1;
+    perror("Error opening capture");
+    return -1;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  reader->size = st.st_size;
+  if (reader->size == 0) {
+    close(fd);
+    return 0;
+  }
+  // Fault every page in now, so replay timings do not include reading the file
+  reader->data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (reader->data == MAP_FAILED) {
+    perror("Error mapping capture");
+    return -1;
+  }
+
+  struct capture_header header;
+  if (reader->size >= sizeof(header) && memcmp(reader->data, CAPTURE_MAGIC, 8) == 0) {
+    memcpy(&header, reader->data, sizeof(header));
+    if (header.frame_size != FRAME_SIZE || header.keyframe_interval == 0 || header.index_offset == 0) {
+      fprintf(stderr, "%s: capture is unfinished or has %u byte frames\n", path, header.frame_size);
+      return -1;
     }
+    if (header.index_offset > reader->size || header.frames > (reader->size - header.index_offset) / sizeof(uint64_t)) {
+      fprintf(stderr, "%s: capture index is truncated\n", path);
+      return -1;
+    }
+    reader->indexed = 1;
+    reader->frames = header.frames;
+    reader->keyframe_interval = header.keyframe_interval;
+    reader->index = malloc(sizeof(uint64_t) * header.frames);
+    memcpy(reader->index, reader->data + header.index_offset, sizeof(uint64_t) * header.frames);
+  } else {
+    reader->frames = reader->size / FRAME_SIZE;
   }
-  // int fd = open("hid2.raw", O_RDWR);
-  // if (fd < 0) {
-  //   perror("Error opening device/file");
-  //   return 1;
-  // }
+  return 0;
+}
 
-  // Call IOCTL to enable heatmaps on surface pro 5
-  uint8_t req[] = {66, 1};
-  int ret = ioctl(fd, HIDIOCSFEATURE(2), &req);
-  if (ret < 0) {
-    perror("Error on ioctl HIDIOCSFEATURE");
+void capture_unmap(struct capture_reader *reader) {
+  if (reader->size) munmap((void *)reader->data, reader->size);
+  free(reader->index);
+}
+
+// Decode the next frame, returns NULL at the end of the capture or if it is corrupt
+const uint8_t *capture_read(struct capture_reader *reader) {
+  if (reader->next >= reader->frames) return NULL;
+  uint64_t n = reader->next++;
+  if (!reader->indexed) {
+    reader->time = (n + 1) * RAW_FRAME_PERIOD_US * 1000ull;
+    return reader->current = reader->data + n * FRAME_SIZE;
+  }
+
+  struct capture_record record;
+  uint64_t offset = reader->index[n];
+  if (offset > reader->size || reader->size - offset < sizeof(record)) return NULL;
+  memcpy(&record, reader->data + offset, sizeof(record));
+  offset += sizeof(record);
+  if (record.size > FRAME_SIZE || reader->size - offset < record.size) return NULL;
+  reader->time = record.time;
+  if (!record.delta) {
+    if (record.size != FRAME_SIZE) return NULL;
+    return reader->current = reader->data + offset;
+  }
+  if (!reader->current) return NULL;
+  if (reader->current != reader->frame) memcpy(reader->frame, reader->current, FRAME_SIZE);
+  if (decode_delta(reader->frame, reader->data + offset, record.size) < 0) return NULL;
+  return reader->current = reader->frame;
+}
+
+// Move to a frame, decoding forward from the keyframe before it
+void capture_seek(struct capture_reader *reader, uint64_t frame) {
+  if (frame > reader->frames) frame = reader->frames;
+  reader->next = reader->indexed ? frame - frame % reader->keyframe_interval : frame;
+  reader->current = NULL;
+  while (reader->next < frame) {
+    if (!capture_read(reader)) break;
+  }
+}
+
+// Replay a capture through process_frame and report timings
+// Indexed captures can be sliced, and replayed at the pace they were recorded, in which case only the time spent
+// processing each frame is measured. Raw captures of concatenated FRAME_SIZE frames have no timestamps and
+// always replay as fast as possible.
+int replay(const char *path, const struct options *options) {
+  int passes = options->passes;
+  struct capture_reader *reader = malloc(sizeof(struct capture_reader));
+  if (capture_open(reader, path) < 0) return 1;
+  uint64_t first = options->slice[0] < reader->frames ? options->slice[0] : reader->frames;
+  uint64_t frames = reader->frames - first;
+  if (options->slice[1] > 0 && options->slice[1] < frames) frames = options->slice[1];
+  if (frames == 0) {
+    fprintf(stderr, "%s: no complete frames\n", path);
     return 1;
   }
+  if (options->realtime && !reader->indexed) fprintf(stderr, "%s: raw captures have no timestamps, replaying as fast as possible\n", path);
 
-  // Allocate memory for file reads, heatmap, and clusters
-  void *buf = malloc(7485);
-  struct pixel *pixels = malloc(sizeof(struct pixel) * WIDTH * HEIGHT);
-  struct cluster_group *cluster_groups = malloc(sizeof(struct cluster_group) * 2);
-  memset(cluster_groups, 0, sizeof(struct cluster_group) * 2);
-  int current_cluster_group = 0;
+  // Events are written to /dev/null unless an output file is given, so emission is part of the measurement
+  int out = open(options->output ? options->output : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    perror("Error opening output");
+    return 1;
+  }
+  struct ipts_state state;
+  init_state(&state, out, out, options);
+  state.nominal_period = !reader->indexed;
+  if (options->record_path && !(state.capture = capture_create(options->record_path))) {
+    perror("Error creating capture");
+    return 1;
+  }
+
+  uint64_t *latencies = malloc(sizeof(uint64_t) * frames * passes);
+  size_t count = 0;
+  uint64_t total_ns = 0;
+  int status = 0;
+  // Added to the capture's times so the clock runs on from one pass into the next rather than back
+  uint64_t clock_base = 0;
+
+  for (int pass = 0; pass < passes && !status; pass++) {
+    capture_seek(reader, first);
+    uint64_t pass_start = now_ns();
+    uint64_t first_time = 0;
+    for (size_t n = 0; n < frames; n++) {
+      const uint8_t *frame = capture_read(reader);
+      if (!frame) {
+        fprintf(stderr, "%s: record %lu is corrupt\n", path, first + n);
+        status = 1;
+        break;
+      }
+      if (n == 0) {
+        first_time = reader->time;
+        if (pass > 0) clock_base = state.frame_ns + RAW_FRAME_PERIOD_US * 1000ull - first_time;
+      }
+      if (options->realtime && reader->indexed) {
+        // Wait until the frame is as far into the replay as it was into the recording
+        uint64_t due = pass_start + (reader->time - first_time);
+        struct timespec ts = {due / 1000000000, due % 1000000000};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) continue;
+      }
+      // A frame read from the device is still in cache when it is processed, so bring this one in before timing
+      for (int i = 0; i < FRAME_SIZE; i += 64) (void)*(volatile const uint8_t *)(frame + i);
+      uint64_t start = now_ns();
+      if (state.capture) capture_write(state.capture, start, frame);
+      state.frame_ns = clock_base + reader->time;
+      process_frame(&state, (void *)frame, FRAME_SIZE);
+      latencies[count] = now_ns() - start;
+      total_ns += latencies[count++];
+    }
+  }
+  capture_unmap(reader);
+  close(out);
+  if (state.stylus_log) stop_stylus_log(state.stylus_log);
+  if (state.capture) capture_close(state.capture);
+
+  qsort(latencies, count, sizeof(uint64_t), compare_u64);
+  if (status) {
+    fprintf(stderr, "%s: %zu frames before the corrupt record in %.3f ms\n", path, count, total_ns / 1e6);
+  } else {
+    fprintf(stderr, "%s: %zu frames x %d passes in %.3f ms, %.0f frames/s\n", path, frames, passes, total_ns / 1e6, count / (total_ns / 1e9));
+  }
+  print_stats(&state);
+  if (count) {
+    fprintf(stderr, "latency ns: p50 %lu, p99 %lu, p999 %lu, max %lu\n", percentile(latencies, count, 0.5), percentile(latencies, count, 0.99),
+            percentile(latencies, count, 0.999), latencies[count - 1]);
+  }
+  free(latencies);
+  return status;
+}
+
+// Step a xorshift generator, used to pick mutations reproducibly
+uint64_t next_random(uint64_t *seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+// Damage a frame the way a faulty device might
+// Most mutations land on the fields the parser has to distrust: the hid, raw and first frame headers, and the
+// headers and stylus element counts of the reports in view, which was taken before the frame was damaged.
+void mutate_frame(uint8_t *frame, const struct frame_view *view, uint64_t *seed) {
+  int mutations = 1 + next_random(seed) % 4;
+  for (int m = 0; m < mutations; m++) {
+    uint64_t r = next_random(seed);
+    size_t at = (r >> 8) % FRAME_SIZE;
+    if (r % 4 == 0) {
+      at = (r >> 8) % (sizeof(struct ipts_hid_header) + sizeof(struct ipts_raw_header) + sizeof(struct ipts_raw_frame_header));
+    } else if (r % 4 == 1 && view->count) {
+      const struct report_view *report = &view->reports[(r >> 8) % view->count];
+      at = report->data - frame - sizeof(struct ipts_report_header) + (r >> 16) % (sizeof(struct ipts_report_header) + 1);
+    }
+    // Extreme values find more size bugs than random ones
+    uint8_t values[] = {0, 0xFF, 0x80, r >> 32};
+    frame[at] = values[(r >> 2) % 4];
+  }
+}
+
+// Run damaged copies of a capture's frames through the parser and the rest of process_frame
+// Each copy is in a buffer of exactly FRAME_SIZE bytes, so a build with -fsanitize=address stops at the first
+// read past the end of a frame. The same seed damages the frames the same way, so a failure can be repeated.
+int fuzz(const char *path, const struct options *options) {
+  struct capture_reader *reader = malloc(sizeof(struct capture_reader));
+  if (capture_open(reader, path) < 0) return 1;
+  if (reader->frames == 0) {
+    fprintf(stderr, "%s: no complete frames\n", path);
+    return 1;
+  }
+  int out = open(options->output ? options->output : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    perror("Error opening output");
+    return 1;
+  }
+  struct ipts_state state;
+  init_state(&state, out, out, options);
+  state.nominal_period = !reader->indexed;
+
+  uint8_t *frame = malloc(FRAME_SIZE);
+  uint64_t seed = options->fuzz_seed ? options->fuzz_seed : 1;
+  int status = 0;
+  uint64_t clock_base = 0;
+  for (uint64_t n = 0; n < options->fuzz; n++) {
+    int wrapped = n % reader->frames == 0;
+    if (wrapped) capture_seek(reader, 0);
+    // Only the copies are damaged, the capture itself has to be intact
+    const uint8_t *original = capture_read(reader);
+    if (!original) {
+      fprintf(stderr, "%s: record %lu is corrupt\n", path, n % reader->frames);
+      status = 1;
+      break;
+    }
+    memcpy(frame, original, FRAME_SIZE);
+    if (wrapped && n > 0) clock_base = state.frame_ns + RAW_FRAME_PERIOD_US * 1000ull - reader->time;
+    state.frame_ns = clock_base + reader->time;
+    struct frame_view view;
+    parse_frame(frame, FRAME_SIZE, &view);
+    mutate_frame(frame, &view, &seed);
+    process_frame(&state, frame, FRAME_SIZE);
+  }
+  capture_unmap(reader);
+  close(out);
+  if (state.stylus_log) stop_stylus_log(state.stylus_log);
+  free(frame);
+  if (status) return status;
+
+  fprintf(stderr, "%s: %lu damaged frames, seed %lu\n", path, options->fuzz, options->fuzz_seed ? options->fuzz_seed : 1);
+  print_stats(&state);
+  return 0;
+}
+
+// The signals the daemon handles through a signalfd, SIGINT and SIGTERM shut down cleanly, SIGUSR1 prints stats
+// These must be blocked in every thread, or one that leaves them unblocked takes their default action and kills
+// the process without tearing down the devices.
+void control_signals(sigset_t *signals) {
+  sigemptyset(signals);
+  sigaddset(signals, SIGINT);
+  sigaddset(signals, SIGTERM);
+  sigaddset(signals, SIGUSR1);
+}
+
+// A frame read from the device, as queued for the processor thread
+struct frame_slot {
+  int length;
+  uint8_t data[FRAME_SIZE];
+};
+
+// Threads and queues of the optional three stage pipeline
+// The main thread reads frames from the device into the frames channel, the processor thread turns them into
+// events which go through the events channel, and the emitter thread writes those to uinput. A stall in one
+// stage only fills its queue, it never delays a device read.
+struct pipeline {
+  struct ipts_state *state;
+  struct channel frames;
+  struct channel events;
+  pthread_t processor;
+  pthread_t emitter;
+  int processor_cpu;
+  int emitter_cpu;
+  _Atomic int stop_processor;
+  _Atomic int stop_emitter;
+  // Frames read while the processor was too far behind to take them
+  uint64_t dropped_reads;
+  // Batches owned by the emitter thread, holding events uinput has not accepted yet
+  struct event_batch touch_events;
+  struct event_batch stylus_events;
+};
+
+// Pin the calling thread to a CPU, a negative CPU leaves it unpinned
+void pin_thread(int cpu) {
+  if (cpu < 0) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret != 0) fprintf(stderr, "Error pinning to CPU %d: %s\n", cpu, strerror(ret));
+}
+
+void *processor_thread(void *arg) {
+  struct pipeline *pipeline = arg;
+  struct ipts_state *state = pipeline->state;
+  pin_thread(pipeline->processor_cpu);
+
+  uint64_t next_housekeeping = now_ns() + HOUSEKEEPING_MS * 1000000ull;
+  while (!atomic_load(&pipeline->stop_processor)) {
+    struct frame_slot *frame;
+    while ((frame = ring_peek(&pipeline->frames.ring))) {
+      process_frame(state, frame->data, frame->length);
+      ring_release(&pipeline->frames.ring);
+    }
+    if (now_ns() >= next_housekeeping) {
+      housekeeping(state);
+      next_housekeeping = now_ns() + HOUSEKEEPING_MS * 1000000ull;
+    }
+    if (channel_wait_begin(&pipeline->frames)) {
+      struct pollfd wakeup = {.fd = pipeline->frames.wakeup, .events = POLLIN};
+      poll(&wakeup, 1, HOUSEKEEPING_MS);
+    }
+    channel_wait_done(&pipeline->frames);
+  }
+  release_touches(state);
+  return NULL;
+}
+
+void *emitter_thread(void *arg) {
+  struct pipeline *pipeline = arg;
+  pin_thread(pipeline->emitter_cpu);
 
   while (1) {
-    // Exit on SDL quit event
-    // while (SDL_PollEvent(&event)) {
-    //   if (event.type == SDL_QUIT) {
-    //     return 0;
-    //   }
-    // }
-
-    // Read a frame from the device
-    int n = read(fd, buf, 7485);
-    if (n < 7485) {
-      // Loop for testing, don't do this on a real device
-      lseek(fd, 0, SEEK_SET);
-      continue;
+    int stop = atomic_load(&pipeline->stop_emitter);
+    struct queued_events *queued;
+    while ((queued = ring_peek(&pipeline->events.ring))) {
+      struct event_batch *batch = queued->fd == pipeline->touch_events.fd ? &pipeline->touch_events : &pipeline->stylus_events;
+      memcpy(reserve_events(batch, queued->count), queued->events, sizeof(struct input_event) * queued->count);
+      ring_release(&pipeline->events.ring);
+      flush_events(batch);
     }
+    if (stop) return NULL;
 
-    struct cluster_group *cluster_group = &cluster_groups[current_cluster_group];
-    memset(cluster_group, 0, sizeof(struct cluster_group));
-    struct cluster_group *previous_cluster_group = &cluster_groups[current_cluster_group ^ 1];
-    struct cluster *clusters = cluster_group->clusters;
-    struct cluster *previous_clusters = previous_cluster_group->clusters;
-    current_cluster_group ^= 1;
-
-    // Parse the received frame data
-    int pos = 0;
-    struct ipts_hid_header *ipts_hid_header = buf;
-    pos += 10;
-    // printf("Report: %i\n", ipts_hid_header->report);
-    // printf("Size: %i\n", ipts_hid_header->size);
-    // printf("Type: %i\n", ipts_hid_header->type);
-    if (ipts_hid_header->type == 0xEE) {
-      struct ipts_raw_header *ipts_raw_header = buf + pos;
-      pos += 12;
-      // printf("Counter: %i\n", ipts_raw_header->counter);
-      // printf("Frames: %i\n", ipts_raw_header->frames);
-      for (int n = 0; n < ipts_raw_header->frames; n++) {
-        struct ipts_raw_frame_header *ipts_raw_frame_header = buf + pos;
-        pos += 16;
-        // printf("  Index: %i\n", ipts_raw_frame_header->index);
-        // printf("  Type: %i\n", ipts_raw_frame_header->type);
-        // printf("  Size: %i\n", ipts_raw_frame_header->size);
-        int eof = pos + ipts_raw_frame_header->size;
-
-        if (ipts_raw_frame_header->type == 6 || ipts_raw_frame_header->type == 8) {
-          while (pos < eof) {
-            struct ipts_report_header *ipts_report_header = buf + pos;
-            pos += 4;
-            // printf("    Report Type: %08x\n", ipts_report_header->type);
-            // printf("    Report Size: %02x\n", ipts_report_header->size);
-            if (ipts_report_header->type == 0x60) {
-              struct ipts_stylus_report *ipts_stylus_report = buf + pos;
-              printf("Stylus data! Serial: %d\n", ipts_stylus_report->serial);
-              // Loop through stylus elements
-              for (int n = 0; n < ipts_stylus_report->elements; n++) {
-                struct ipts_stylus_element *ipts_stylus_element = buf + pos + 8 + n * 16;
-                printf("  Element: Mode: %02x, X: %d, Y: %d\n", ipts_stylus_element->mode, ipts_stylus_element->x, ipts_stylus_element->y);
-                printf("    Pressure: %d, Altitude: %d, Azimuth: %d\n", ipts_stylus_element->pressure, ipts_stylus_element->altitude, ipts_stylus_element->azimuth);
-                uint8_t proximity = ipts_stylus_element->mode & 0x01;
-                uint8_t contact = ipts_stylus_element->mode & 0x02;
-                uint8_t button = ipts_stylus_element->mode & 0x04;
-                uint8_t eraser = ipts_stylus_element->mode & 0x08;
-                if (proximity) {
-                  emit(uinput_stylus, EV_ABS, ABS_X, ipts_stylus_element->x);
-                  emit(uinput_stylus, EV_ABS, ABS_Y, ipts_stylus_element->y);
-                  emit(uinput_stylus, EV_ABS, ABS_TILT_X, 0);
-                  emit(uinput_stylus, EV_ABS, ABS_TILT_Y, 0);
-                  emit(uinput_stylus, EV_ABS, ABS_PRESSURE, ipts_stylus_element->pressure);
-                  emit(uinput_stylus, EV_KEY, BTN_TOUCH, !!contact);
-                  emit(uinput_stylus, EV_KEY, BTN_TOOL_PEN, 0);
-                  emit(uinput_stylus, EV_KEY, BTN_TOOL_RUBBER, 0);
-                  emit(uinput_stylus, EV_KEY, BTN_STYLUS, 0);
-
-                  emit(uinput_stylus, EV_SYN, SYN_REPORT, 0);
-                }
-              }
-            } else if (ipts_report_header->type == 0x25) {
-              // We have heatmap data, start processing!
-              uint8_t *raw_pixels = buf + pos;
-              int disable_touch = 0;
-
-              // Copy pixels from raw frame and invert both axes as well as the values
-              for (int y = 0; y < HEIGHT; y++) {
-                for (int x = 0; x < WIDTH; x++) {
-                  uint8_t xx = WIDTH - x - 1;
-                  uint8_t yy = HEIGHT - y - 1;
-                  int value = 255 - raw_pixels[yy * WIDTH + xx] - 100;
-                  if (value < 0) value = 0;
-                  pixels[y * WIDTH + x].value = value;
-                  pixels[y * WIDTH + x].x = x;
-                  pixels[y * WIDTH + x].y = y;
-                }
-              }
+    // Sleep until more events arrive, or a device with events still queued becomes writable
+    struct pollfd fds[3] = {{.fd = pipeline->events.wakeup, .events = POLLIN}};
+    int count = 1;
+    if (pipeline->touch_events.count) fds[count++] = (struct pollfd){.fd = pipeline->touch_events.fd, .events = POLLOUT};
+    if (pipeline->stylus_events.count) fds[count++] = (struct pollfd){.fd = pipeline->stylus_events.fd, .events = POLLOUT};
+    if (channel_wait_begin(&pipeline->events)) poll(fds, count, -1);
+    channel_wait_done(&pipeline->events);
+    flush_events(&pipeline->touch_events);
+    flush_events(&pipeline->stylus_events);
+  }
+}
 
-              // Group pixels into clusters
-              cluster_group->size = 0;
-              for (int y = 0; y < HEIGHT; y++) {
-                for (int x = 0; x < WIDTH; x++) {
-                  // First identify the brightest pixels in the heatmap
-                  // These are pixels that have no brighter neighbor
-                  if (is_brightest(pixels, x, y)) {
-                    // For each bright spot, create a cluster and add surrounding pixels to it recursively
-                    if (cluster_group->size < MAX_CLUSTERS) assign_group_dimmer(pixels, x, y, &clusters[cluster_group->size++], pixels[y * WIDTH + x].value);
-                  }
-                }
-              }
+struct pipeline *start_pipeline(struct ipts_state *state, int processor_cpu, int emitter_cpu) {
+  struct pipeline *pipeline = calloc(1, sizeof(struct pipeline));
+  pipeline->state = state;
+  pipeline->processor_cpu = processor_cpu;
+  pipeline->emitter_cpu = emitter_cpu;
+  channel_init(&pipeline->frames, PIPELINE_FRAMES, sizeof(struct frame_slot));
+  channel_init(&pipeline->events, PIPELINE_BATCHES, sizeof(struct queued_events));
+  pipeline->touch_events.fd = state->touch_events.fd;
+  pipeline->stylus_events.fd = state->stylus_events.fd;
+  state->touch_events.channel = &pipeline->events;
+  state->stylus_events.channel = &pipeline->events;
+  // The threads must not take the signals run handles, so they start with them blocked whatever the caller's mask
+  sigset_t signals;
+  sigset_t previous;
+  control_signals(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+  pthread_create(&pipeline->processor, NULL, processor_thread, pipeline);
+  pthread_create(&pipeline->emitter, NULL, emitter_thread, pipeline);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  return pipeline;
+}
 
-              // Calculate bounds of each cluster
-              // We use floats to do this in the device space. We can convert to screen space later
-              for (int i = 0; i < cluster_group->size; i++) {
-                // Use each pixel's position and value to create a weighted average position
-                float weighted_x = 0;
-                float weighted_y = 0;
-                float total_weight = 0;
-                for (int j = 0; j < clusters[i].size; j++) {
-                  weighted_x += clusters[i].pixels[j].x * clusters[i].pixels[j].value;
-                  weighted_y += clusters[i].pixels[j].y * clusters[i].pixels[j].value;
-                  total_weight += clusters[i].pixels[j].value;
-                }
-                clusters[i].centre_x = weighted_x / total_weight + 0.5;
-                clusters[i].centre_y = weighted_y / total_weight + 0.5;
-                clusters[i].diameter = total_weight / 100;
-                // Use the centre of the cluster and total weight to approximate a bounding box
-                clusters[i].x1 = clusters[i].centre_x - clusters[i].diameter / 2;
-                clusters[i].y1 = clusters[i].centre_y - clusters[i].diameter / 2;
-                clusters[i].x2 = clusters[i].centre_x + clusters[i].diameter / 2;
-                clusters[i].y2 = clusters[i].centre_y + clusters[i].diameter / 2;
-                // Mark all clusters as valid intially
-                // We could add additional checks here to filter out clusters that are too small or too large
-                if (clusters[i].diameter > 0.5f) clusters[i].valid = 1;
-                if (clusters[i].diameter > 10.f) disable_touch = 1;
-              }
+// Stop the processor, then let the emitter write out everything it was given
+void stop_pipeline(struct pipeline *pipeline) {
+  atomic_store(&pipeline->stop_processor, 1);
+  channel_wake(&pipeline->frames);
+  pthread_join(pipeline->processor, NULL);
+  atomic_store(&pipeline->stop_emitter, 1);
+  channel_wake(&pipeline->events);
+  pthread_join(pipeline->emitter, NULL);
+}
 
-              if (disable_touch) {
-                // If we have a cluster that is too large, disable touch
-                for (int i = 0; i < cluster_group->size; i++) {
-                  clusters[i].valid = 0;
-                }
-              }
+// Read every frame that is waiting straight into the frames channel
+// Returns -1 if the device failed.
+int read_frames(int fd, struct pipeline *pipeline, void *buf) {
+  while (1) {
+    struct frame_slot *slot = ring_reserve(&pipeline->frames.ring);
+    uint8_t *frame = slot ? slot->data : buf;
+    int n = read(fd, frame, FRAME_SIZE);
+    if (n < 0) {
+      if (errno == EAGAIN) return 0;
+      if (errno == EINTR) continue;
+      perror("Error reading device");
+      return -1;
+    }
+    if (n == 0) return 0;
+    memset(frame + n, 0, FRAME_SIZE - n);
+    if (pipeline->state->capture) capture_write(pipeline->state->capture, now_ns(), frame);
+    if (slot) {
+      slot->length = n;
+      channel_commit(&pipeline->frames);
+    } else {
+      pipeline->dropped_reads++;
+    }
+  }
+}
 
-              // Remove overlapping clusters
-              for (int i = 0; i < cluster_group->size; i++) {
-                for (int j = i + 1; j < cluster_group->size; j++) {
-                  if (clusters[i].valid && clusters[j].valid) {
-                    // Calculate the intersection of each pair of clusters
-                    float intersection = fmax(0, fmin(clusters[i].x2, clusters[j].x2) - fmax(clusters[i].x1, clusters[j].x1)) * fmax(0, fmin(clusters[i].y2, clusters[j].y2) - fmax(clusters[i].y1, clusters[j].y1));
-                    // Calculate the area of each cluster in the pair
-                    float area_i = (clusters[i].x2 - clusters[i].x1) * (clusters[i].y2 - clusters[i].y1);
-                    float area_j = (clusters[j].x2 - clusters[j].x1) * (clusters[j].y2 - clusters[j].y1);
-                    // If the intersection is greater than 50% of the smaller cluster, invalidate it
-                    if (area_i > area_j) {
-                      if (intersection / area_j > 0.25) {
-                        clusters[j].valid = 0;
-                      }
-                    } else {
-                      if (intersection / area_i > 0.25) {
-                        clusters[i].valid = 0;
-                      }
-                    }
-                  }
-                }
-              }
+// Start or stop waiting for a uinput device to accept queued events
+void watch_output(int epoll, struct event_batch *batch) {
+  uint8_t waiting = batch->count > 0;
+  if (waiting == batch->waiting) return;
+  struct epoll_event ev = {.events = waiting ? EPOLLOUT : 0, .data.fd = batch->fd};
+  epoll_ctl(epoll, EPOLL_CTL_MOD, batch->fd, &ev);
+  batch->waiting = waiting;
+}
 
-              // Attempt to collelate clusters with those from previous frames
-              // This is done by iterating through previous clusters and finding the closest match in the current frame
-              for (int n = 0; n < previous_cluster_group->size; n++) {
-                if (!previous_clusters[n].valid) continue;
-                float closest_distance = 1000000;
-                int closest_index = -1;
-                for (int m = 0; m < cluster_group->size; m++) {
-                  if (clusters[m].valid && clusters[m].id == 0) {
-                    float distance = pow(clusters[m].centre_x - previous_clusters[n].centre_x, 2) + pow(clusters[m].centre_y - previous_clusters[n].centre_y, 2);
-                    if (distance < closest_distance) {
-                      closest_distance = distance;
-                      closest_index = m;
-                    }
-                  }
-                }
-                if (closest_index != -1) {
-                  clusters[closest_index].id = previous_clusters[n].id;
-                }
-              }
+// Process frames from the device until a signal asks us to stop
+// The hidraw device, both uinput devices, a housekeeping timer and a signalfd are all handled from one epoll
+// loop, so none of them hold up the others. With a pipeline, this thread only reads frames and handles
+// signals, and the uinput devices and housekeeping belong to the pipeline threads.
+int run(int fd, struct ipts_state *state, struct pipeline *pipeline, void *buf) {
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
 
-              // Assign new IDs to any clusters that don't have one yet
-              for (int m = 0; m < cluster_group->size; m++) {
-                if (clusters[m].valid && clusters[m].id == 0) {
-                  // Find the lowest unused ID
-                  int id = 1;
-                  while (1) {
-                    int found = 0;
-                    for (int n = 0; n < cluster_group->size; n++) {
-                      if (clusters[n].id == id) {
-                        found = 1;
-                        break;
-                      }
-                    }
-                    if (!found) break;
-                    id++;
-                  }
-                  clusters[m].id = id;
-                }
-              }
+  // The signals were blocked in main, before any other thread was started
+  sigset_t signals;
+  control_signals(&signals);
+  int control = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
 
-              // Draw raw data to screen
-              // for (int y = 0; y < HEIGHT; y++) {
-              //   for (int x = 0; x < WIDTH; x++) {
-              //     int xx = WIDTH - x - 1;
-              //     int yy = HEIGHT - y - 1;
-              //     uint8_t pixel = 255 - raw_pixels[yy * WIDTH + xx];
-              //     SDL_Rect rect;
-              //     rect.x = x * SCALE;
-              //     rect.y = y * SCALE;
-              //     rect.w = SCALE;
-              //     rect.h = SCALE;
-              //     SDL_SetRenderDrawColor(ren, pixel, pixel, pixel, 255);
-              //     SDL_RenderFillRect(ren, &rect);
-              //   }
-              // }
-
-              // Draw clusters to screen
-              // int valid_clusters = 0;
-              // for (int i = 0; i < cluster_group->size; i++) {
-              //   SDL_Rect rect;
-              //   rect.x = clusters[i].x1 * SCALE;
-              //   rect.y = clusters[i].y1 * SCALE;
-              //   rect.w = clusters[i].diameter * SCALE;
-              //   rect.h = clusters[i].diameter * SCALE;
-              //   if (clusters[i].valid) {
-              //     SDL_SetRenderDrawColor(ren, 0, 255, 0, 255);
-              //     valid_clusters++;
-              //     char text[100];
-              //     sprintf(text, "%d", clusters[i].id);
-              //     SDL_Surface *surface;
-              //     SDL_Color color = {0, 0, 0};
-              //     surface = TTF_RenderText_Solid(font, text, color);
-              //     SDL_Texture *texture = SDL_CreateTextureFromSurface(ren, surface);
-              //     SDL_Rect dstrect = {rect.x, rect.y, surface->w, surface->h};
-              //     SDL_FreeSurface(surface);
-              //     SDL_RenderCopy(ren, texture, NULL, &dstrect);
-              //     SDL_DestroyTexture(texture);
-              //   } else {
-              //     SDL_SetRenderDrawColor(ren, 255, 0, 0, 255);
-              //   }
-              //   SDL_RenderDrawRect(ren, &rect);
-              // }
-
-              // Draw cluster count to screen
-              // char text[100];
-              // sprintf(text, "Clusters: %d", valid_clusters);
-              // SDL_Surface *surface;
-              // SDL_Color color = {0, 0, 0};
-              // surface = TTF_RenderText_Solid(font, text, color);
-              // SDL_Texture *texture = SDL_CreateTextureFromSurface(ren, surface);
-              // SDL_Rect dstrect = {0, 0, surface->w, surface->h};
-              // SDL_FreeSurface(surface);
-              // SDL_RenderCopy(ren, texture, NULL, &dstrect);
-              // SDL_DestroyTexture(texture);
-
-              // Update screen
-              // SDL_RenderPresent(ren);
-
-              int valid_clusters = 0;
-              for (int n = 0; n < cluster_group->size; n++) {
-                if (clusters[n].valid) {
-                  valid_clusters++;
-                }
-              }
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec interval = {{0, HOUSEKEEPING_MS * 1000000L}, {0, HOUSEKEEPING_MS * 1000000L}};
+  timerfd_settime(timer, 0, &interval, NULL);
 
-              // Emit to uinput
-              for (int n = 0; n < 6; n++) {
-                emit(uinput, EV_ABS, ABS_MT_SLOT, n);
-                int tracking_id = -1;
-                for (int i = 0; i < cluster_group->size; i++) {
-                  if (clusters[i].id == n + 1 && clusters[i].valid) {
-                    emit(uinput, EV_ABS, ABS_MT_POSITION_X, clusters[i].centre_x * SCALE);
-                    emit(uinput, EV_ABS, ABS_MT_POSITION_Y, clusters[i].centre_y * SCALE);
-                    emit(uinput, EV_ABS, ABS_MT_TOUCH_MAJOR, clusters[i].diameter * SCALE);
-                    tracking_id = clusters[i].id;
-                    if (valid_clusters == 1) {
-                      emit(uinput, EV_ABS, ABS_X, clusters[i].centre_x * SCALE);
-                      emit(uinput, EV_ABS, ABS_Y, clusters[i].centre_y * SCALE);
-                      emit(uinput, EV_KEY, BTN_TOUCH, 1);
-                    }
-                  }
-                }
-                emit(uinput, EV_ABS, ABS_MT_TRACKING_ID, tracking_id);
-              }
-              if (valid_clusters != 1) {
-                emit(uinput, EV_KEY, BTN_TOUCH, 0);
-              }
+  int watched[] = {fd, control, timer, state->touch_events.fd, state->stylus_events.fd};
+  for (int i = 0; i < (pipeline ? 3 : 5); i++) {
+    // The uinput devices are only watched while they have events queued
+    struct epoll_event ev = {.events = i < 3 ? EPOLLIN : 0, .data.fd = watched[i]};
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, watched[i], &ev) < 0) {
+      perror("Error on epoll_ctl");
+      return 1;
+    }
+  }
 
-              emit(uinput, EV_SYN, SYN_REPORT, 0);
+  uint64_t dropped = 0;
+  while (1) {
+    struct epoll_event events[8];
+    int count = epoll_wait(epoll, events, 8, -1);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      perror("Error on epoll_wait");
+      return 1;
+    }
 
-              // Sleep 100ms
-              // nanosleep((const struct timespec[]){{0, 50000000L}}, NULL);
+    for (int e = 0; e < count; e++) {
+      int ready = events[e].data.fd;
+      if (ready == fd && pipeline) {
+        if (read_frames(fd, pipeline, buf) < 0) return 1;
+      } else if (ready == fd) {
+        // Read every frame that is waiting, hidraw returns one report per read
+        while (1) {
+          int n = read(fd, buf, FRAME_SIZE);
+          if (n < 0) {
+            if (errno == EAGAIN) break;
+            if (errno == EINTR) continue;
+            perror("Error reading device");
+            return 1;
+          }
+          if (n == 0) break;
+          // Captures hold whole FRAME_SIZE records, so a shorter frame is recorded with zeros after it
+          memset((uint8_t *)buf + n, 0, FRAME_SIZE - n);
+          if (state->capture) capture_write(state->capture, now_ns(), buf);
+          process_frame(state, buf, n);
+        }
+      } else if (ready == state->touch_events.fd) {
+        flush_events(&state->touch_events);
+      } else if (ready == state->stylus_events.fd) {
+        flush_events(&state->stylus_events);
+      } else if (ready == timer) {
+        uint64_t expirations;
+        read(timer, &expirations, sizeof(expirations));
+        if (!pipeline) housekeeping(state);
+        uint64_t total = state->touch_events.dropped + state->stylus_events.dropped;
+        if (pipeline) total += pipeline->touch_events.dropped + pipeline->stylus_events.dropped + pipeline->dropped_reads;
+        if (total != dropped) {
+          fprintf(stderr, "Dropped %lu frames, not keeping up with the device\n", total - dropped);
+          dropped = total;
+        }
+      } else if (ready == control) {
+        struct signalfd_siginfo info;
+        while (read(control, &info, sizeof(info)) == sizeof(info)) {
+          if (info.ssi_signo == SIGUSR1) {
+            // The counters are owned by the processor thread, but a slightly stale copy is fine to print
+            print_stats(state);
+            if (pipeline) {
+              fprintf(stderr, "pipeline drops: reads %lu, touch %lu, stylus %lu\n", pipeline->dropped_reads, pipeline->touch_events.dropped,
+                      pipeline->stylus_events.dropped);
+            }
+          } else {
+            if (pipeline) {
+              stop_pipeline(pipeline);
+            } else {
+              release_touches(state);
             }
-            pos += ipts_report_header->size;
+            ioctl(state->touch_events.fd, UI_DEV_DESTROY);
+            ioctl(state->stylus_events.fd, UI_DEV_DESTROY);
+            if (state->stylus_log) stop_stylus_log(state->stylus_log);
+            if (state->capture) capture_close(state->capture);
+            return 0;
           }
+        }
+      }
+    }
+
+    if (!pipeline) {
+      watch_output(epoll, &state->touch_events);
+      watch_output(epoll, &state->stylus_events);
+    }
+  }
+}
+
+void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [--verbose] [--pipeline] [--cpus R,P,E] [--record FILE] [--replay FILE] [--passes N] [--output FILE]\n", name);
+  fprintf(stderr, "  -v, --verbose      print stylus elements from a background thread\n");
+  fprintf(stderr, "  -p, --pipeline     read, process and emit on separate threads\n");
+  fprintf(stderr, "  -c, --cpus R,P,E   pin the reader, processor and emitter threads to these CPUs, -1 to leave one unpinned\n");
+  fprintf(stderr, "  -C, --centroid M   find touch centres by 'mean' of the cluster (default) or sub-pixel 'peak' fit\n");
+  fprintf(stderr, "  -G, --segment M    split the heatmap into touches by 'watershed' (default), by a 'fill' from each peak, or\n");
+  fprintf(stderr, "                     into its connected 'components'\n");
+  fprintf(stderr, "  -I, --isa NAME     run the heatmap kernels built for 'default', 'avx2' or 'avx512' rather than the best the CPU supports\n");
+  fprintf(stderr, "  -P, --predict MS   emit where each touch is expected to be MS milliseconds ahead (default 0)\n");
+  fprintf(stderr, "  -S, --stylus-rate HZ[,PHASE]  resample the stylus to HZ positions a second, on a grid offset PHASE microseconds from\n");
+  fprintf(stderr, "                     the monotonic clock to line up with vblank\n");
+  fprintf(stderr, "  -w, --record FILE  record the frames read to an indexed capture\n");
+  fprintf(stderr, "  -r, --replay FILE  process a capture without uinput and print timings, raw frames or an indexed capture\n");
+  fprintf(stderr, "  -s, --slice F[,N]  replay N frames starting from frame F (default all)\n");
+  fprintf(stderr, "  -t, --realtime     replay an indexed capture at the pace it was recorded\n");
+  fprintf(stderr, "  -n, --passes N     number of times to replay the capture (default 1)\n");
+  fprintf(stderr, "  -F, --fuzz N[,SEED]  instead of replaying, process N damaged copies of the capture's frames\n");
+  fprintf(stderr, "  -o, --output FILE  write the replayed input_events to FILE instead of discarding them\n");
+}
+
+int main(int argc, char **argv) {
+  struct options options = {
+      .passes = 1,
+      .cpus = {-1, -1, -1},
+      .centroid = CENTROID_MEAN,
+      .segment = SEGMENT_WATERSHED,
+      .isa = detect_isa(),
+  };
+
+  struct option long_options[] = {
+      {"record", required_argument, 0, 'w'},
+      {"replay", required_argument, 0, 'r'},
+      {"slice", required_argument, 0, 's'},
+      {"realtime", no_argument, 0, 't'},
+      {"passes", required_argument, 0, 'n'},
+      {"fuzz", required_argument, 0, 'F'},
+      {"output", required_argument, 0, 'o'},
+      {"verbose", no_argument, 0, 'v'},
+      {"pipeline", no_argument, 0, 'p'},
+      {"cpus", required_argument, 0, 'c'},
+      {"centroid", required_argument, 0, 'C'},
+      {"segment", required_argument, 0, 'G'},
+      {"isa", required_argument, 0, 'I'},
+      {"predict", required_argument, 0, 'P'},
+      {"stylus-rate", required_argument, 0, 'S'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "w:r:s:tn:F:o:vpc:C:G:I:P:S:h", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'w':
+        options.record_path = optarg;
+        break;
+      case 'r':
+        options.replay_path = optarg;
+        break;
+      case 's':
+        sscanf(optarg, "%lu,%lu", &options.slice[0], &options.slice[1]);
+        break;
+      case 't':
+        options.realtime = 1;
+        break;
+      case 'n':
+        options.passes = atoi(optarg);
+        if (options.passes < 1) options.passes = 1;
+        break;
+      case 'F':
+        sscanf(optarg, "%lu,%lu", &options.fuzz, &options.fuzz_seed);
+        break;
+      case 'o':
+        options.output = optarg;
+        break;
+      case 'v':
+        options.verbose = 1;
+        break;
+      case 'p':
+        options.pipeline = 1;
+        break;
+      case 'c':
+        sscanf(optarg, "%d,%d,%d", &options.cpus[0], &options.cpus[1], &options.cpus[2]);
+        break;
+      case 'C':
+        if (strcmp(optarg, "mean") == 0) {
+          options.centroid = CENTROID_MEAN;
+        } else if (strcmp(optarg, "peak") == 0) {
+          options.centroid = CENTROID_PEAK;
         } else {
-          pos = eof;
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'G':
+        if (strcmp(optarg, "watershed") == 0) {
+          options.segment = SEGMENT_WATERSHED;
+        } else if (strcmp(optarg, "fill") == 0) {
+          options.segment = SEGMENT_FILL;
+        } else if (strcmp(optarg, "components") == 0) {
+          options.segment = SEGMENT_COMPONENTS;
+        } else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'I': {
+        enum isa best = detect_isa();
+        for (options.isa = 0; options.isa < ISA_COUNT; options.isa++) {
+          if (strcmp(optarg, isa_names[options.isa]) == 0) break;
         }
+        if (options.isa == ISA_COUNT) {
+          usage(argv[0]);
+          return 1;
+        }
+        if (options.isa > best) {
+          fprintf(stderr, "Instruction set '%s' is not supported here\n", optarg);
+          return 1;
+        }
+        break;
       }
+      case 'S':
+        sscanf(optarg, "%d,%d", &options.stylus_rate, &options.stylus_phase_us);
+        if (options.stylus_phase_us < 0) options.stylus_phase_us = 0;
+        break;
+      case 'P':
+        options.predict_ms = atoi(optarg);
+        if (options.predict_ms < 0) options.predict_ms = 0;
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
     }
-    // printf("\n");
-    fflush(stdout);
   }
-  return 0;
+
+  if (options.replay_path && options.fuzz) return fuzz(options.replay_path, &options);
+  if (options.replay_path) return replay(options.replay_path, &options);
+
+  // Initialize SDL for testing
+  // SDL_Init(SDL_INIT_VIDEO);
+  // TTF_Init();
+  // SDL_Event event;
+  // SDL_Window *win = SDL_CreateWindow("Tablet", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH * SCALE, HEIGHT * SCALE, 0);
+  // SDL_Renderer *ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+  // SDL_Texture *tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WIDTH * SCALE, HEIGHT * SCALE);
+  // TTF_Font *font = TTF_OpenFont("OpenSans-Regular.ttf", 24);
+
+  // Open a hidraw device
+  int fd = open("/dev/hidraw0", O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    fd = open("/dev/hidraw1", O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+      perror("Error opening device/file");
+      return 1;
+    }
+  }
+
+  // Call IOCTL to enable heatmaps on surface pro 5
+  uint8_t req[] = {66, 1};
+  int ret = ioctl(fd, HIDIOCSFEATURE(2), &req);
+  if (ret < 0) {
+    perror("Error on ioctl HIDIOCSFEATURE");
+    return 1;
+  }
+
+  // Open uinput devices for touch and stylus data
+  // The touch device is given the heatmap's aspect ratio, one heatmap pixel is SCALE units along either axis
+  const struct geometry *geometry = probe_geometry(fd);
+  int uinput = setup_touch_device(geometry->width * SCALE, geometry->height * SCALE);
+  int uinput_stylus = setup_stylus_device();
+
+  // Block the signals run handles before starting any thread, threads inherit the mask they are created with
+  sigset_t signals;
+  control_signals(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  // Allocate memory for file reads, heatmap, and clusters
+  void *buf = malloc(FRAME_SIZE);
+  struct ipts_state state;
+  init_state(&state, uinput, uinput_stylus, &options);
+  state.touch_max_x = geometry->width * SCALE;
+  state.touch_max_y = geometry->height * SCALE;
+  if (options.record_path && !(state.capture = capture_create(options.record_path))) {
+    perror("Error creating capture");
+    return 1;
+  }
+
+  // Without a pipeline everything runs on this thread, which is pinned to the reader CPU
+  pin_thread(options.cpus[0]);
+  struct pipeline *pipeline = options.pipeline ? start_pipeline(&state, options.cpus[1], options.cpus[2]) : NULL;
+  return run(fd, &state, pipeline, buf);
 }
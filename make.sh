@@ -1,4 +1,5 @@
 #!/bin/bash
 set -e
-gcc -O3 ipts.c -lpng -lm -lSDL2 -lSDL2_ttf -o ipts
+gcc -O3 -fno-math-errno ipts.c -lpng -lm -lSDL2 -lSDL2_ttf -pthread -o ipts
 #./ipts
+#./ipts --replay hid.raw --passes 10